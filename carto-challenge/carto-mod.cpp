@@ -29,179 +29,755 @@
 #include <iostream>
 #include <chrono>
 #include <cstring>
-#include <fstream>
-#include <sstream>
 #include <algorithm>
-#include <cmath>
-#include <thread>
-#include <future>
+#include <string>
+#include <memory>
+#include <stdexcept>
+#include <cerrno>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "render.h"
 
 using std::chrono::high_resolution_clock;
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
 using std::memset;
 
-namespace
+/**
+ * command line options
+ */
+struct options
 {
-    // tile bbox
-    const float BBOX[] = { 4970241.3272153, -8257645.03970416,  5009377.08569731, -8218509.28122215 };
+    const char* filename;
+    // aggregate while reading instead of loading all the rows first
+    bool stream;
+    // keep the points as rows instead of columns, for comparison
+    bool aos;
+    // binning kernel for point columns
+    std::string kernel;
+    // time every kernel instead of rendering
+    bool bench;
+    // worker threads, 0 for one per hardware thread
+    unsigned threads;
+    // partition the points and pin the workers per NUMA node
+    bool numa;
+    // pin every worker to one CPU: compact, scatter or a CPU list
+    std::string pin;
+    // fixed point sums, giving the same output for any number of threads
+    bool deterministic;
+    // sort the points by Morton code before binning them
+    bool sort;
+    // compute the pixel of every point once, before the timed runs
+    bool cache;
+    // bucket the cached points by pixel, and reduce every pixel on its own
+    bool csr;
+    // with csr, render this percentile of the amounts of every pixel
+    float percentile;
+    // index the points by web mercator cells, and only bin the tile's ones
+    bool index;
+    // tile to render as zoom/x/y, the default one if empty
+    std::string tile;
     // tile size in pixels
-    const uint32_t pixel_resolution = 256;
-    // resolution per in meters per pixel
-    const float resolution = 152.874056570353;
-    // helper
-    const float resolution_inv = 1.0/resolution;
-    const int grid_size = pixel_resolution * pixel_resolution;
-
-    const int CONCURRENCY_LEVEL = 2;
+    uint32_t resolution;
+    // write a binary P5 graymap instead of a text P2 one
+    bool p5;
+    // write a PNG instead, and its compression
+    bool png;
+    png_compression compression;
+    // with png, write RGBA pixels, transparent where there are no points
+    bool rgba;
+    // zoom levels below the tile to render too, binning the points once
+    int pyramid;
+    // file listing tiles of one zoom level to render in one pass, if any
+    std::string tiles;
+    // directory to write the pyramid or listed tiles to, as zoom/x/y files
+    std::string out;
+    // gray ramp: exponent, gray levels and lookup table size
+    float gamma;
+    uint32_t low;
+    uint32_t high;
+    std::size_t ramp_size;
+
+    options():
+        filename(nullptr), stream(false), aos(false), kernel("auto"), bench(false), threads(0),
+        numa(false), deterministic(false), sort(false), cache(false), csr(false),
+        percentile(-1), index(false), resolution(pixel_resolution), p5(false),
+        png(false), compression(png_compression::rle), rgba(false), pyramid(0), gamma(0.4f), low(15), high(255), ramp_size(4096)
+    {}
 };
 
-struct row
+void usage(const char* program)
 {
-    float x, y, amount;
-};
+    std::cerr << program << " [--stream] [--aos] [--kernel NAME] [--threads N] [--numa] [--pin compact|scatter|CPUS] [--deterministic] [--sort] [--cache] [--csr] [--percentile Q] [--index] [--tile Z/X/Y] [--resolution N] [--p5] [--png stored|rle] [--rgba] [--pyramid LEVELS | --tiles FILE] [--out DIR] [--gamma G] [--levels LOW-HIGH] [--ramp-size N] [--bench] file.csv" << std::endl;
+    std::cerr << "kernels: auto";
+    for (const auto& kernel: bin_kernels(pixel_resolution))
+    {
+        std::cerr << " " << kernel.name;
+    }
+    std::cerr << std::endl;
+    exit(-1);
+}
 
-struct grid_pixel
+options parse_options(int argc, char** argv)
 {
-    float avg;
-    uint32_t count;
+    options opts;
+    // std::sto* and parse_png_compression() throw std::invalid_argument or
+    // std::out_of_range on a bad value
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg == "--stream")
+            {
+                opts.stream = true;
+            }
+            else if (arg == "--aos")
+            {
+                opts.aos = true;
+            }
+            else if (arg == "--kernel" && i + 1 < argc)
+            {
+                opts.kernel = argv[++i];
+            }
+            else if (arg == "--threads" && i + 1 < argc)
+            {
+                opts.threads = std::stoul(argv[++i]);
+                if (opts.threads < 1 || opts.threads > 4096)
+                {
+                    usage(argv[0]);
+                }
+            }
+            else if (arg == "--numa")
+            {
+                opts.numa = true;
+            }
+            else if (arg == "--pin" && i + 1 < argc)
+            {
+                opts.pin = argv[++i];
+            }
+            else if (arg == "--deterministic")
+            {
+                opts.deterministic = true;
+            }
+            else if (arg == "--sort")
+            {
+                opts.sort = true;
+            }
+            else if (arg == "--cache")
+            {
+                opts.cache = true;
+            }
+            else if (arg == "--csr")
+            {
+                opts.cache = opts.csr = true;
+            }
+            else if (arg == "--percentile" && i + 1 < argc)
+            {
+                opts.cache = opts.csr = true;
+                opts.percentile = std::stof(argv[++i]);
+                if (!(opts.percentile >= 0 && opts.percentile <= 100))
+                {
+                    usage(argv[0]);
+                }
+            }
+            else if (arg == "--index")
+            {
+                opts.index = true;
+            }
+            else if (arg == "--tile" && i + 1 < argc)
+            {
+                opts.tile = argv[++i];
+            }
+            else if (arg == "--resolution" && i + 1 < argc)
+            {
+                opts.resolution = std::stoul(argv[++i]);
+                if (opts.resolution < 1 || opts.resolution > 4096)
+                {
+                    usage(argv[0]);
+                }
+            }
+            else if (arg == "--p5")
+            {
+                opts.p5 = true;
+            }
+            else if (arg == "--png" && i + 1 < argc)
+            {
+                opts.png = true;
+                opts.compression = parse_png_compression(argv[++i]);
+            }
+            else if (arg == "--rgba")
+            {
+                opts.rgba = true;
+            }
+            else if (arg == "--pyramid" && i + 1 < argc)
+            {
+                opts.pyramid = std::stoi(argv[++i]);
+                if (opts.pyramid < 1 || opts.pyramid > 12)
+                {
+                    usage(argv[0]);
+                }
+            }
+            else if (arg == "--tiles" && i + 1 < argc)
+            {
+                opts.tiles = argv[++i];
+            }
+            else if (arg == "--out" && i + 1 < argc)
+            {
+                opts.out = argv[++i];
+            }
+            else if (arg == "--gamma" && i + 1 < argc)
+            {
+                opts.gamma = std::stof(argv[++i]);
+            }
+            else if (arg == "--levels" && i + 1 < argc &&
+                     std::sscanf(argv[i + 1], "%u-%u", &opts.low, &opts.high) == 2)
+            {
+                ++i;
+            }
+            else if (arg == "--ramp-size" && i + 1 < argc)
+            {
+                opts.ramp_size = std::stoul(argv[++i]);
+            }
+            else if (arg == "--bench")
+            {
+                opts.bench = true;
+            }
+            else if (arg.compare(0, 2, "--") == 0 || opts.filename)
+            {
+                usage(argv[0]);
+            }
+            else
+            {
+                opts.filename = argv[i];
+            }
+        }
+    }
+    catch (const std::logic_error&)
+    {
+        usage(argv[0]);
+    }
+    if (!opts.filename)
+    {
+        usage(argv[0]);
+    }
+    if (opts.deterministic && (opts.stream || opts.numa))
+    {
+        std::cerr << "--deterministic does not work with --stream or --numa" << std::endl;
+        exit(-1);
+    }
+    if ((opts.sort || opts.cache || opts.index) && (opts.stream || opts.numa || opts.aos))
+    {
+        std::cerr << "--sort, --cache, --csr and --index do not work with --stream, --numa or --aos" << std::endl;
+        exit(-1);
+    }
+    if (opts.index && (opts.sort || opts.cache))
+    {
+        std::cerr << "--index does not work with --sort, --cache or --csr" << std::endl;
+        exit(-1);
+    }
+    if (opts.cache && opts.resolution != pixel_resolution)
+    {
+        std::cerr << "--cache and --csr only work with 256x256 tiles" << std::endl;
+        exit(-1);
+    }
+    if (opts.csr && opts.deterministic)
+    {
+        // bucket sums are already independent of the threads
+        std::cerr << "--csr does not need --deterministic" << std::endl;
+        exit(-1);
+    }
+    if ((opts.p5 && opts.png) || (opts.rgba && !opts.png))
+    {
+        std::cerr << "--png does not work with --p5, and --rgba needs --png" << std::endl;
+        exit(-1);
+    }
+    if ((!opts.pyramid && opts.tiles.empty()) != opts.out.empty() || (opts.pyramid && !opts.tiles.empty()))
+    {
+        std::cerr << "--out goes with either --pyramid or --tiles" << std::endl;
+        exit(-1);
+    }
+    if (!opts.tiles.empty() && (opts.stream || opts.numa || opts.aos || opts.sort || opts.cache || opts.index ||
+                                opts.deterministic || !opts.tile.empty()))
+    {
+        // every tile is binned by one worker, in point order
+        std::cerr << "--tiles only works with --resolution and --threads, and needs no --deterministic"
+                  << std::endl;
+        exit(-1);
+    }
+    if (opts.pyramid && (opts.stream || opts.numa || opts.aos || opts.sort || opts.cache || opts.index ||
+                         opts.deterministic))
+    {
+        // the finest level is binned by bands of rows, in point order
+        std::cerr << "--pyramid only works with --tile, --resolution and --threads, and needs no --deterministic"
+                  << std::endl;
+        exit(-1);
+    }
+    if (opts.resolution << opts.pyramid > 4096)
+    {
+        // the finest level is a single grid of that many pixels a side
+        std::cerr << "--pyramid needs at most 4096 pixels a side at its finest level" << std::endl;
+        exit(-1);
+    }
+    return opts;
+}
 
-    grid_pixel():
-        avg(0.0f), count(0)
-    {}
-};
+/**
+ * writes a grid to `fd` in the format of the options
+ */
+void write_image(const tile_grid& grid, const color_ramp& ramp, const options& opts, int fd = STDOUT_FILENO)
+{
+    if (opts.png)
+    {
+        write_png(grid, ramp, opts.compression, opts.rgba, fd);
+    }
+    else
+    {
+        write_ppm(grid, ramp, opts.p5, fd);
+    }
+}
 
 /**
- * reads a CSV file (well, space separated values) with this format:
- * amount x y
+ * creates directory `path` if it does not exist yet. Throws
+ * std::runtime_error if that fails.
  */
-void read(std::vector<row>& rows, const char* filename)
+void make_directory(const std::string& path)
 {
-    std::ifstream file(filename);
-    std::string line;
-    while (std::getline(file, line))
+    if (::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
     {
-        row r;
-        std::sscanf(line.c_str(), "%f %f %f", &r.amount, &r.y, &r.x);
-        rows.push_back(r);
+        throw std::runtime_error("cannot create " + path + ": " + std::strerror(errno));
     }
 }
 
-void sequential_grid(
-  std::vector<row>::const_iterator begin,
-  std::vector<row>::const_iterator end,
-  std::promise<std::vector<grid_pixel>> promise)
+/**
+ * writes tile `zoom`/`x`/`y` to opts.out/zoom/x/y.ppm (or .png), creating
+ * the directories. Throws std::runtime_error if the file cannot be created.
+ */
+void write_tile(const tile_grid& grid, int zoom, uint32_t x, uint32_t y, const color_ramp& ramp,
+                const options& opts)
+{
+    std::string path = opts.out;
+    make_directory(path);
+    path += "/" + std::to_string(zoom);
+    make_directory(path);
+    path += "/" + std::to_string(x);
+    make_directory(path);
+    path += "/" + std::to_string(y) + (opts.png ? ".png" : ".ppm");
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot create " + path + ": " + std::strerror(errno));
+    }
+    write_image(grid, ramp, opts, fd);
+    ::close(fd);
+}
+
+/**
+ * writes every tile of `pyramid`, whose finest level is `finest`, with
+ * write_tile(), `zoom`, `x` and `y` being those of its top tile. Returns how
+ * many tiles it wrote.
+ */
+std::size_t write_pyramid(const histogram& finest, const tile_pyramid& pyramid, int zoom, uint32_t x, uint32_t y,
+                          const color_ramp& ramp, const options& opts)
 {
-    std::vector<grid_pixel> hist;
-    hist.resize(grid_size);
+    tile_grid tile(std::size_t(pyramid.tile_pixels) * pyramid.tile_pixels);
+    std::size_t written = 0;
+    for (int level = 0; level <= pyramid.levels(); ++level)
+    {
+        const histogram& grid = level < pyramid.levels() ? pyramid.coarse[level] : finest;
+        const uint32_t tiles = 1u << level;
+        for (uint32_t i = 0; i < tiles; ++i)
+        {
+            for (uint32_t j = 0; j < tiles; ++j)
+            {
+                sub_tile(grid, pyramid.level_pixels(level), pyramid.tile_pixels, i, j, tile);
+                // sub tiles go north along i and east along j, tile rows
+                // down from the north
+                write_tile(tile, zoom + level, (x << level) + j, (y << level) + tiles - 1 - i, ramp, opts);
+                ++written;
+            }
+        }
+    }
+    return written;
+}
 
-    for(auto it = begin; it != end; ++it)
+/**
+ * the tiles listed in file `path`, one "zoom/x/y" per line, skipping blank
+ * lines. Throws std::runtime_error if it cannot be read.
+ */
+std::vector<std::string> read_tile_list(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        throw std::runtime_error("cannot read " + path);
+    }
+    std::vector<std::string> tiles;
+    std::string line;
+    while (std::getline(file, line))
     {
-        const auto& r = *it;
-        if (r.x > BBOX[0] && r.x < BBOX[2] && r.y > BBOX[1] && r.y < BBOX[3])
+        line.erase(0, line.find_first_not_of(" \t"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (!line.empty())
         {
-            uint32_t x = resolution_inv * (r.x - BBOX[0]);
-            uint32_t y = resolution_inv * (r.y - BBOX[1]);
-            grid_pixel& px = hist[x * pixel_resolution + y];
-            ++px.count;
-            px.avg += r.amount;
+            tiles.push_back(line);
         }
     }
-    promise.set_value(hist);
+    return tiles;
 }
 
 /**
- * calculates 256x256 grid with avg values
+ * CPUs for every worker of the pool. With --numa workers stay on their node,
+ * and --pin compact or scatter pins each one to a single CPU of that node.
+ * Without it, --pin spreads the workers over all CPUs.
  */
-std::vector<grid_pixel> grid(const std::vector<row>& rows)
+std::vector<std::vector<int>> worker_affinity(const options& opts, const numa_layout& layout)
 {
-  std::vector<std::promise<std::vector<grid_pixel>>> result_promises(CONCURRENCY_LEVEL);
-  std::vector<std::future<std::vector<grid_pixel>>> result_futures;
-  for (auto& promise : result_promises) {
-    result_futures.push_back(promise.get_future());
-  }
-
-  auto split_size = rows.size() / CONCURRENCY_LEVEL;
-  std::vector<std::thread> workers(CONCURRENCY_LEVEL);
-  for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-    workers[i] = std::thread(sequential_grid,
-                             rows.begin() + split_size * i,
-                             rows.begin() + split_size * (i + 1),
-                             std::move(result_promises[i]));
-  }
-
-  for (auto& worker : workers) {
-    worker.join();
-  }
-
-  std::vector<std::vector<grid_pixel>> results;
-  for (auto& future : result_futures) {
-    results.push_back(future.get());
-  }
-
-  std::vector<grid_pixel> merged_result(grid_size);
-  for (std::size_t i = 0; i < grid_size; i++) {
-    auto& pixel = merged_result[i];
-    for (auto& result : results) {
-      pixel.count += result[i].count;
-      pixel.avg += result[i].avg;
-    }
-    if (pixel.count) {
-      pixel.avg /= pixel.count;
-    }
-  }
-
-  return merged_result;
+    std::vector<std::vector<int>> affinity;
+    if (opts.numa)
+    {
+        affinity = layout.affinity();
+        if (!opts.pin.empty())
+        {
+            if (opts.pin != "compact" && opts.pin != "scatter")
+            {
+                throw std::invalid_argument("--numa only takes --pin compact or scatter");
+            }
+            for (unsigned worker = 0; worker < layout.threads(); ++worker)
+            {
+                const auto& workers = layout.workers[layout.node_of[worker]];
+                std::size_t rank = std::find(workers.begin(), workers.end(), worker) - workers.begin();
+                affinity[worker] = { affinity[worker][rank % affinity[worker].size()] };
+            }
+        }
+    }
+    else if (!opts.pin.empty())
+    {
+        for (int cpu: pin_cpus(opts.pin, layout.nodes, layout.threads()))
+        {
+            affinity.push_back({ cpu });
+        }
+    }
+    return affinity;
 }
 
 /**
- * writes a grid to a ppm file to stdout
+ * writes the CPU every worker last ran on, for pinned benchmarks
  */
-void write_ppm(const std::vector<grid_pixel>& grid) {
+void report_cpus(const thread_pool& pool)
+{
+    std::cerr << "CPUs:";
+    for (unsigned worker = 0; worker < pool.size(); ++worker)
+    {
+        std::cerr << " " << pool.worker_cpu(worker);
+    }
+    std::cerr << std::endl;
+}
 
-    std::cout << "P2" << std::endl;
-    std::cout << "256 256" << std::endl;
-    std::cout << "256" << std::endl;
+/**
+ * best time of 5 runs of grid(points, pool, arena), in milliseconds
+ */
+template <typename Points, typename Arena>
+double best_grid_time(const Points& points, thread_pool& pool, Arena& arena)
+{
+    long best = -1;
+    for (int i = 0; i < 5; i++)
+    {
+        high_resolution_clock::time_point t1 = high_resolution_clock::now();
+        grid(points, pool, arena);
+        high_resolution_clock::time_point t2 = high_resolution_clock::now();
+        long us = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+        best = best < 0 ? us : std::min(best, us);
+    }
+    return best / 1000.0;
+}
 
-    // calculate the max to normalize
-    const auto& max_px = std::max_element(grid.begin(), grid.end(), [] (const grid_pixel& a, const grid_pixel& b) { return a.count*a.avg < b.count*b.avg; });
-    float max = max_px->avg * max_px->count;
+/**
+ * runs `render` 5 times, writing the rows loaded and the time of every run
+ * like the original program, and with --pin the CPUs the workers ran on.
+ * Returns the time of the 5 runs, of which only `render` is timed.
+ */
+template <typename Render>
+std::chrono::microseconds timed_runs(std::size_t rows, const options& opts, const thread_pool& pool,
+                                     const Render& render)
+{
+    std::chrono::microseconds total(0);
+    for (int i = 0; i < 5; i++)
+    {
+        std::cerr << "Loaded " << rows << "rows " << std::endl;
+        high_resolution_clock::time_point t1 = high_resolution_clock::now();
+        render();
+        high_resolution_clock::time_point t2 = high_resolution_clock::now();
+        total += duration_cast<std::chrono::microseconds>(t2 - t1);
+        std::cerr << "Time: " << duration_cast<milliseconds>(t2 - t1).count() << "ms" << std::endl;
+        if (!opts.pin.empty())
+        {
+            report_cpus(pool);
+        }
+    }
+    return total;
+}
 
-    for(int32_t x = pixel_resolution - 1; x >= 0; --x) {
-        for(uint32_t y = 0; y < pixel_resolution; ++y) {
-            const auto& px = grid[x * pixel_resolution + y];
-            float avg = std::pow(px.avg*px.count/max, 0.4f);
-            std::cout << 15 + uint32_t(avg*240) << " ";
+/**
+ * times grid() over `points` with every kernel this CPU supports, with
+ * deterministic fixed point sums, over cached pixels, over pixel buckets
+ * and through the spatial index, reporting the best of 5 runs of each. All
+ * but the kernel runs bin with the kernel of --kernel.
+ */
+void bench_kernels(const column_view& points, thread_pool& pool)
+{
+    const bin_kernel selected = column_kernel;
+    const unsigned selected_lanes = column_lanes;
+    for (const auto& kernel: bin_kernels(TILE.pixel_resolution))
+    {
+        if (!kernel.supported)
+        {
+            continue;
         }
-        std::cout << std::endl;
+        column_kernel = kernel.fn;
+        column_lanes = kernel.lanes;
+        grid_arena arena(pool.size());
+        std::cerr << "kernel " << kernel.name << ": " << best_grid_time(points, pool, arena) << "ms" << std::endl;
+    }
+    // the rest bins with the kernel of --kernel
+    column_kernel = selected;
+    column_lanes = selected_lanes;
+    grid_arena arena(pool.size());
+
+    fixed_arena fixed(pool.size());
+    std::cerr << "deterministic: " << best_grid_time(points, pool, fixed) << "ms" << std::endl;
+
+    spatial_index cells(points, pool, tile_zoom + index_zoom_levels, index_max_cells);
+    std::cerr << "index: " << best_grid_time(cells, pool, arena) << "ms" << std::endl;
+
+    if (TILE.pixel_resolution == pixel_resolution)
+    {
+        pixel_index index(points, pool);
+        std::cerr << "cached: " << best_grid_time(index, pool, arena) << "ms" << std::endl;
+
+        pixel_buckets buckets(index, pool);
+        std::cerr << "csr: " << best_grid_time(buckets, pool, arena.merged) << "ms" << std::endl;
     }
 }
 
 int main (int argc, char** argv)
 {
-
-    if (argc != 2)
+    options opts = parse_options(argc, argv);
+    std::unique_ptr<color_ramp> ramp_table;
+    try
+    {
+        set_tile(opts.tile, opts.resolution);
+        if (tile_zoom + opts.pyramid > 30)
+        {
+            throw std::invalid_argument("--pyramid goes past zoom level 30");
+        }
+        ramp_table.reset(new color_ramp(opts.gamma, opts.low, opts.high, opts.ramp_size));
+    }
+    catch (const std::exception& e)
     {
-        std::cerr << argv[0] << "file.csv" << std::endl;
+        std::cerr << e.what() << std::endl;
+        exit(-1);
+    }
+    const color_ramp& ramp = *ramp_table;
+    kernel_info kernel = find_bin_kernel(opts.kernel, TILE.pixel_resolution);
+    column_kernel = kernel.fn;
+    column_lanes = kernel.lanes;
+    if (!column_kernel)
+    {
+        std::cerr << "kernel " << opts.kernel << " is not available on this CPU" << std::endl;
         exit(-1);
     }
 
+    unsigned threads = opts.threads ? opts.threads : std::max(1u, std::thread::hardware_concurrency());
+    numa_layout layout(numa_nodes(), threads);
+    std::unique_ptr<thread_pool> workers;
+    try
+    {
+        workers.reset(new thread_pool(opts.numa ? layout.threads() : threads, worker_affinity(opts, layout)));
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        exit(-1);
+    }
+    thread_pool& pool = *workers;
+    grid_arena arena(pool.size());
+    fixed_arena fixed(opts.deterministic ? pool.size() : 0);
     std::vector<row> rows;
-    // Reserve space to reduce the number of reallocations
-    rows.reserve(10000000);
+    point_columns columns;
+    tile_grid g;
 
-    // load rows, it will take some time, you do **not** need to optimize this part
-    read(rows, argv[1]);
+    try
+    {
+        if (opts.stream)
+        {
+            std::size_t count;
+            high_resolution_clock::time_point t1 = high_resolution_clock::now();
+            g = stream_grid(opts.filename, pool, count);
+            high_resolution_clock::time_point t2 = high_resolution_clock::now();
+            std::cerr << "Streamed " << count << "rows " << std::endl;
+            std::cerr << "Time: " << duration_cast<milliseconds>(t2 - t1).count() << "ms" << std::endl;
+            write_image(g, ramp, opts);
+            return 0;
+        }
+
+        if (opts.bench)
+        {
+            read(columns, opts.filename, pool.size());
+            bench_kernels(columns.view(), pool);
+            return 0;
+        }
+
+        if (opts.numa)
+        {
+            read(columns, opts.filename, pool.size());
+            high_resolution_clock::time_point t1 = high_resolution_clock::now();
+            numa_points points(columns.view(), pool, layout);
+            numa_arena numa(pool, layout);
+            high_resolution_clock::time_point t2 = high_resolution_clock::now();
+            std::cerr << "Partitioned over " << layout.nodes.size() << " nodes: "
+                      << duration_cast<milliseconds>(t2 - t1).count() << "ms" << std::endl;
+            timed_runs(columns.size(), opts, pool, [&] { g = numa_grid(points, pool, layout, numa); });
+            write_image(g, ramp, opts);
+            return 0;
+        }
+
+        if (opts.pyramid)
+        {
+            read(columns, opts.filename, pool.size());
+            // a pyramid bins the points at its finest level, too large for
+            // a partial grid per worker
+            refine_tile(opts.pyramid);
+            band_arena bands;
+            tile_pyramid pyramid(opts.resolution, opts.pyramid);
+            const histogram* finest = nullptr;
+            timed_runs(columns.size(), opts, pool, [&] {
+                finest = &band_grid(columns.view(), pool, bands);
+                build_pyramid(*finest, pool, pyramid);
+            });
+
+            uint32_t x = BBOX_X, y = BBOX_Y;
+            if (!opts.tile.empty())
+            {
+                parse_tile(opts.tile, tile_zoom, x, y);
+            }
+            // the tiles are written at their own size
+            set_tile(opts.tile, opts.resolution);
+            high_resolution_clock::time_point t1 = high_resolution_clock::now();
+            std::size_t tiles = write_pyramid(*finest, pyramid, tile_zoom, x, y, ramp, opts);
+            high_resolution_clock::time_point t2 = high_resolution_clock::now();
+            std::cerr << "Wrote " << tiles << " tiles of zoom " << tile_zoom << " to " << tile_zoom + opts.pyramid
+                      << ": " << duration_cast<milliseconds>(t2 - t1).count() << "ms" << std::endl;
+            return 0;
+        }
+
+        if (!opts.tiles.empty())
+        {
+            tile_batch batch(read_tile_list(opts.tiles), opts.resolution);
+            read(columns, opts.filename, pool.size());
+            timed_runs(columns.size(), opts, pool, [&] { batch_grid(columns.view(), pool, batch); });
+
+            high_resolution_clock::time_point t1 = high_resolution_clock::now();
+            for (std::size_t slot = 0; slot < batch.size(); ++slot)
+            {
+                write_tile(batch.grids[slot], batch.zoom, batch.xs[slot], batch.ys[slot], ramp, opts);
+            }
+            high_resolution_clock::time_point t2 = high_resolution_clock::now();
+            std::cerr << "Wrote " << batch.size() << " tiles of zoom " << batch.zoom << ": "
+                      << duration_cast<milliseconds>(t2 - t1).count() << "ms" << std::endl;
+            return 0;
+        }
+
+        // load rows, it will take some time, you do **not** need to optimize this part
+        if (opts.aos)
+        {
+            read(rows, opts.filename, pool.size());
+        }
+        else
+        {
+            read(columns, opts.filename, pool.size());
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        exit(-1);
+    }
+
+    // with --sort, time the 5 runs over the points as read first, then sort
+    // them and compare the sort cost with what the sorted runs save. Runs
+    // time grid() alone, not copying its result
+    column_view points = columns.view();
+    point_columns sorted;
+    std::chrono::microseconds unsorted_time(0), sort_time(0), sorted_time(0);
+    // --deterministic throws once pixel sums overflow
+    try {
+      if (opts.sort) {
+        unsorted_time = timed_runs(columns.size(), opts, pool, [&] {
+          opts.deterministic ? grid(points, pool, fixed) : grid(points, pool, arena);
+        });
+        high_resolution_clock::time_point t1 = high_resolution_clock::now();
+        sort_points(points, pool, sorted);
+        sort_time = duration_cast<std::chrono::microseconds>(high_resolution_clock::now() - t1);
+        points = sorted.view();
+      }
+
+      std::unique_ptr<pixel_index> index;
+      if (opts.cache) {
+        high_resolution_clock::time_point t1 = high_resolution_clock::now();
+        index.reset(new pixel_index(points, pool));
+        high_resolution_clock::time_point t2 = high_resolution_clock::now();
+        std::cerr << "Cached pixels: " << duration_cast<milliseconds>(t2 - t1).count() << "ms" << std::endl;
+      }
+
+      std::unique_ptr<spatial_index> cells;
+      if (opts.index) {
+        high_resolution_clock::time_point t1 = high_resolution_clock::now();
+        cells.reset(new spatial_index(points, pool, tile_zoom + index_zoom_levels, index_max_cells));
+        high_resolution_clock::time_point t2 = high_resolution_clock::now();
+        std::cerr << "Indexed " << cells->cells() << " cells of zoom " << cells->zoom() << ": "
+                  << duration_cast<milliseconds>(t2 - t1).count() << "ms" << std::endl;
+      }
+
+      std::unique_ptr<pixel_buckets> buckets;
+      std::vector<std::vector<float>> scratch(pool.size());
+      if (opts.csr) {
+        high_resolution_clock::time_point t1 = high_resolution_clock::now();
+        buckets.reset(new pixel_buckets(*index, pool));
+        high_resolution_clock::time_point t2 = high_resolution_clock::now();
+        std::cerr << "Bucketed pixels: " << duration_cast<milliseconds>(t2 - t1).count() << "ms" << std::endl;
+      }
+
+      const tile_grid* result = nullptr;
+      sorted_time = timed_runs(opts.aos ? rows.size() : columns.size(), opts, pool, [&] {
+        if (cells) {
+          result = opts.deterministic ? &grid(*cells, pool, fixed) : &grid(*cells, pool, arena);
+        } else if (buckets && opts.percentile >= 0) {
+          result = &percentile_grid(*buckets, pool, opts.percentile, scratch, arena.merged);
+        } else if (buckets) {
+          result = &grid(*buckets, pool, arena.merged);
+        } else if (index) {
+          result = opts.deterministic ? &grid(*index, pool, fixed) : &grid(*index, pool, arena);
+        } else if (opts.deterministic) {
+          result = opts.aos ? &grid(rows, pool, fixed) : &grid(points, pool, fixed);
+        } else {
+          result = opts.aos ? &grid(rows, pool, arena) : &grid(points, pool, arena);
+        }
+      });
+      g = *result;
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      exit(-1);
+    }
 
-    std::vector<grid_pixel> g;
-    for (int i = 0; i < 5; i++) {
-      std::cerr << "Loaded " << rows.size() << "rows " << std::endl;
-      high_resolution_clock::time_point t1 = high_resolution_clock::now();
-      g = grid(rows);
-      high_resolution_clock::time_point t2 = high_resolution_clock::now();
-      std::cerr << "Time: " << duration_cast<milliseconds>(t2 - t1).count() << "ms" << std::endl;
+    if (opts.sort) {
+      std::cerr << "Morton sort: " << sort_time.count() / 1000.0 << "ms, 5 runs unsorted: "
+                << unsorted_time.count() / 1000.0 << "ms, sorted: " << sorted_time.count() / 1000.0
+                << "ms" << std::endl;
     }
 
-    write_ppm(g);
+    write_image(g, ramp, opts);
     return 0;
 }
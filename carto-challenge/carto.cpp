@@ -29,11 +29,11 @@
 #include <iostream>
 #include <chrono>
 #include <cstring>
-#include <fstream>
-#include <sstream>
 #include <algorithm>
 #include <cmath>
 
+#include "csv.h"
+
 using std::chrono::high_resolution_clock;
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
@@ -52,11 +52,6 @@ namespace
     const int grid_size = pixel_resolution * pixel_resolution;
 };
 
-struct row
-{
-    float x, y, amount;
-};
-
 struct grid_pixel
 {
     float avg;
@@ -67,26 +62,6 @@ struct grid_pixel
     {}
 };
 
-/**
- * reads a CSV file (well, space separated values) with this format:
- * amount x y
- */
-void read(std::vector<row>& rows, const char* filename)
-{
-    std::ifstream file(filename);
-    std::string line;
-    while (std::getline(file, line))
-    {
-        row r;
-        std::istringstream iss(line);
-        if (!(iss >> r.amount >> r.y >> r.x))
-        {
-            break;
-        }
-        rows.push_back(r);
-    }
-}
-
 /**
  * calculates 256x256 grid with avg values
  */
@@ -154,7 +129,15 @@ int main (int argc, char** argv)
     std::vector<row> rows;
 
     // load rows, it will take some time, you do **not** need to optimize this part
-    read(rows, argv[1]);
+    try
+    {
+        read(rows, argv[1]);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        exit(-1);
+    }
 
     std::vector<grid_pixel> g;
     for (int i = 0; i < 5; i++) {
@@ -0,0 +1,1071 @@
+/*
+ * Self-checks of the torque-mod engine, kept out of torque-mod itself: the
+ * kernels and grids against serial references, the color ramp, the PNGs
+ * through a small inflate decoder, pyramids and tile batches. This program
+ * also replaces the global allocator to count heap allocations, which
+ * torque-mod must not pay for.
+ *
+ * execute with:
+ *   # ./torque-check [--kernel NAME] [--tile Z/X/Y] [--resolution N] tile.csv
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "render.h"
+
+namespace
+{
+    // heap allocations made so far, see check_allocations()
+    std::atomic<std::size_t> allocations(0);
+
+    void* counted_alloc(std::size_t size) noexcept
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return std::malloc(size ? size : 1);
+    }
+};
+
+// every form of the global allocator is replaced, so that whatever form
+// allocates, the matching one frees
+void* operator new(std::size_t size)
+{
+    if (void* p = counted_alloc(size))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_alloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_alloc(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+/**
+ * tells whether two histograms have the same counts and sums, the sums
+ * being allowed to differ by float rounding (relative `tolerance`)
+ */
+bool same_grid(const histogram& a, const histogram& b, float tolerance)
+{
+    for (int i = 0; i < grid_size; ++i)
+    {
+        if (a.count[i] != b.count[i] ||
+            std::abs(a.sum[i] - b.sum[i]) > tolerance * std::abs(b.sum[i]) + 1e-3f)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * same_grid() for merged grids, also comparing their averages, and checking
+ * that the largest sum of `a` is right
+ */
+bool same_grid(const tile_grid& a, const tile_grid& b, float tolerance)
+{
+    if (a.max_sum != *std::max_element(a.sum.begin(), a.sum.end()))
+    {
+        return false;
+    }
+    for (int i = 0; i < grid_size; ++i)
+    {
+        if (std::abs(a.avg[i] - b.avg[i]) > tolerance * std::abs(b.avg[i]) + 1e-3f)
+        {
+            return false;
+        }
+    }
+    return same_grid(static_cast<const histogram&>(a), static_cast<const histogram&>(b), tolerance);
+}
+
+/**
+ * tells whether two merged grids are bit for bit the same
+ */
+bool identical_grid(const tile_grid& a, const tile_grid& b)
+{
+    return a.size() == b.size() && a.max_sum == b.max_sum &&
+        std::memcmp(a.sum.data(), b.sum.data(), a.size() * sizeof(float)) == 0 &&
+        std::memcmp(a.count.data(), b.count.data(), a.size() * sizeof(uint32_t)) == 0 &&
+        std::memcmp(a.avg.data(), b.avg.data(), a.size() * sizeof(float)) == 0;
+}
+
+/**
+ * checks that every kernel this CPU supports bins `points` like the scalar
+ * one: bit for bit for exact kernels, and with the same counts and sums
+ * equal up to float rounding for the others. Returns false on any mismatch.
+ */
+bool check_kernels(const column_view& points)
+{
+    histogram expected(grid_size);
+    bin_scalar<0>(TILE, points, 0, points.size, expected.ref());
+
+    bool ok = true;
+    for (const auto& kernel: bin_kernels(TILE.pixel_resolution))
+    {
+        if (!kernel.supported)
+        {
+            std::cerr << "kernel " << kernel.name << ": not supported" << std::endl;
+            continue;
+        }
+        histogram lanes(grid_size * kernel.lanes);
+        kernel.fn(TILE, points, 0, points.size, lanes.ref());
+        histogram hist(grid_size);
+        add_slice(hist, lanes, 0, grid_size);
+        bool same = kernel.exact ?
+            std::memcmp(hist.sum.data(), expected.sum.data(), grid_size * sizeof(float)) == 0 &&
+            std::memcmp(hist.count.data(), expected.count.data(), grid_size * sizeof(uint32_t)) == 0 :
+            same_grid(hist, expected, 1e-5f);
+        std::cerr << "kernel " << kernel.name << ": " << (same ? "ok" : "MISMATCH") << std::endl;
+        ok = ok && same;
+    }
+    return ok;
+}
+
+/**
+ * saves the globals of the tile being rendered (TILE, tile_zoom, grid_size,
+ * column_kernel and column_lanes) and puts them back when it goes out of
+ * scope, for the checks that render other tiles or bin with other kernels
+ */
+struct saved_tile
+{
+    const tile_geometry tile;
+    const int zoom;
+    const int size;
+    const bin_kernel kernel;
+    const unsigned lanes;
+
+    saved_tile():
+        tile(TILE), zoom(tile_zoom), size(grid_size), kernel(column_kernel), lanes(column_lanes)
+    {}
+
+    ~saved_tile()
+    {
+        restore();
+    }
+
+    void restore() const
+    {
+        TILE = tile;
+        tile_zoom = zoom;
+        grid_size = size;
+        column_kernel = kernel;
+        column_lanes = lanes;
+    }
+};
+
+/**
+ * checks that every kernel bins points just inside the max edges of tile
+ * 0/0/0, where pixel coordinates round up to the tile size, in the last
+ * pixels like tile_pixel() does, at the specialized and at another size.
+ * Returns false on any mismatch.
+ */
+bool check_edges()
+{
+    const saved_tile saved;
+    bool ok = true;
+    for (uint32_t pixels: { pixel_resolution, 1000u })
+    {
+        set_tile("0/0/0", pixels);
+        const float max_x = TILE.bbox[2], max_y = TILE.bbox[3];
+        std::vector<row> rows(4 * simd_width);
+        for (std::size_t i = 0; i < rows.size(); ++i)
+        {
+            // below the max edges by one float step or by 2 meters, or in
+            // the middle of the tile
+            rows[i].x = i % 4 == 3 ? 0.0f : i % 2 ? std::nextafter(max_x, 0.0f) : max_x - 2.0f;
+            rows[i].y = i % 4 == 2 ? 0.0f : i % 3 ? std::nextafter(max_y, 0.0f) : max_y - 2.0f;
+            rows[i].amount = 1.0f;
+        }
+        point_columns points;
+        points.assign(rows);
+        column_view view = points.view();
+
+        histogram expected(grid_size);
+        for (std::size_t i = 0; i < view.size; ++i)
+        {
+            uint32_t px_x, px_y;
+            if (tile_pixel(TILE, view.x[i], view.y[i], px_x, px_y) && px_x < pixels && px_y < pixels)
+            {
+                ++expected.count[px_x * pixels + px_y];
+                expected.sum[px_x * pixels + px_y] += view.amount[i];
+            }
+            else if (ok)
+            {
+                std::cerr << "tile_pixel() at the edges of " << pixels << " pixels: MISMATCH" << std::endl;
+                ok = false;
+            }
+        }
+        for (const auto& kernel: bin_kernels(pixels))
+        {
+            if (!kernel.supported)
+            {
+                continue;
+            }
+            histogram lanes(grid_size * kernel.lanes);
+            kernel.fn(TILE, view, 0, view.size, lanes.ref());
+            histogram hist(grid_size);
+            add_slice(hist, lanes, 0, grid_size);
+            // points binned out of the grid are missing from it
+            bool same = same_grid(hist, expected, 0.0f) &&
+                std::accumulate(hist.count.begin(), hist.count.end(), std::size_t(0)) == view.size;
+            std::cerr << "kernel " << kernel.name << " at the edges of " << pixels << " pixels: "
+                      << (same ? "ok" : "MISMATCH") << std::endl;
+            ok = ok && same;
+        }
+    }
+    return ok;
+}
+
+/**
+ * the serial grid() of carto.cpp, as the reference for the parallel one
+ */
+tile_grid serial_grid(const std::vector<row>& rows)
+{
+    tile_grid hist(grid_size);
+
+    for(const auto& r: rows)
+    {
+        uint32_t x, y;
+        if (tile_pixel(TILE, r.x, r.y, x, y))
+        {
+            uint32_t p = x * TILE.pixel_resolution + y;
+            ++hist.count[p];
+            hist.sum[p] += r.amount;
+        }
+    }
+
+    for(int i = 0; i < grid_size; ++i)
+    {
+        if (hist.count[i])
+        {
+            hist.avg[i] = hist.sum[i] / hist.count[i];
+        }
+    }
+    hist.max_sum = *std::max_element(hist.sum.begin(), hist.sum.end());
+    return hist;
+}
+
+/**
+ * the largest amount of every pixel, as percentile_grid() gives it for the
+ * 100th percentile
+ */
+tile_grid max_grid(const std::vector<row>& rows)
+{
+    tile_grid hist(grid_size);
+    for (const auto& r: rows)
+    {
+        uint32_t x, y;
+        if (tile_pixel(TILE, r.x, r.y, x, y))
+        {
+            uint32_t p = x * TILE.pixel_resolution + y;
+            hist.sum[p] = hist.count[p]++ ? std::max(hist.sum[p], r.amount) : r.amount;
+            hist.avg[p] = hist.sum[p];
+        }
+    }
+    hist.max_sum = *std::max_element(hist.sum.begin(), hist.sum.end());
+    return hist;
+}
+
+/**
+ * checks the parallel grid() against serial_grid(), over rows and columns,
+ * with several pool sizes and point counts that do not split evenly in
+ * chunks. Returns false on any mismatch.
+ */
+bool check_grid(const column_view& points)
+{
+    bool ok = true;
+    const std::size_t sizes[] = { points.size, points.size - 1, 12345, 7, 0 };
+    for (std::size_t size: sizes)
+    {
+        column_view view = points;
+        view.size = std::min(size, points.size);
+        std::vector<row> rows(view.size);
+        for (std::size_t i = 0; i < view.size; ++i)
+        {
+            rows[i].x = view.x[i];
+            rows[i].y = view.y[i];
+            rows[i].amount = view.amount[i];
+        }
+        auto expected = serial_grid(rows);
+        tile_grid deterministic;
+
+        for (unsigned threads = 1; threads <= 3; ++threads)
+        {
+            thread_pool pool(threads);
+            grid_arena arena(pool.size());
+            bool same = same_grid(grid(view, pool, arena), expected, 1e-4f) &&
+                        same_grid(grid(rows, pool, arena), expected, 1e-4f);
+            std::cerr << "grid of " << view.size << " rows on " << threads << " threads: "
+                      << (same ? "ok" : "MISMATCH") << std::endl;
+            ok = ok && same;
+
+            // fixed point sums must not change at all with the threads
+            fixed_arena fixed(pool.size());
+            if (threads == 1)
+            {
+                deterministic = grid(view, pool, fixed);
+            }
+            same = same_grid(grid(view, pool, fixed), expected, 1e-4f) &&
+                   identical_grid(grid(view, pool, fixed), deterministic) &&
+                   identical_grid(grid(rows, pool, fixed), deterministic);
+            std::cerr << "deterministic grid of " << view.size << " rows on " << threads << " threads: "
+                      << (same ? "ok" : "MISMATCH") << std::endl;
+            ok = ok && same;
+
+            spatial_index cells(view, pool, tile_zoom + index_zoom_levels, index_max_cells);
+            same = same_grid(grid(cells, pool, arena), expected, 1e-4f);
+            std::cerr << "indexed grid of " << view.size << " rows on " << threads << " threads: "
+                      << (same ? "ok" : "MISMATCH") << std::endl;
+            ok = ok && same;
+
+            // cached pixels are 16 bits
+            if (TILE.pixel_resolution == pixel_resolution)
+            {
+                pixel_index index(view, pool);
+                same = same_grid(grid(index, pool, arena), expected, 1e-4f) &&
+                       identical_grid(grid(index, pool, fixed), deterministic);
+                std::cerr << "cached grid of " << view.size << " rows on " << threads << " threads: "
+                          << (same ? "ok" : "MISMATCH") << std::endl;
+                ok = ok && same;
+
+                // buckets add in point order, exactly like serial_grid()
+                pixel_buckets buckets(index, pool);
+                tile_grid bucketed(grid_size);
+                std::vector<std::vector<float>> scratch(pool.size());
+                tile_grid highest(grid_size);
+                same = identical_grid(grid(buckets, pool, bucketed), expected) &&
+                       identical_grid(percentile_grid(buckets, pool, 100, scratch, highest), max_grid(rows));
+                std::cerr << "csr grid of " << view.size << " rows on " << threads << " threads: "
+                          << (same ? "ok" : "MISMATCH") << std::endl;
+                ok = ok && same;
+            }
+
+            point_columns sorted;
+            sort_points(view, pool, sorted);
+            same = sorted.size() == view.size && same_grid(grid(sorted.view(), pool, arena), expected, 1e-4f);
+            // points outside the tile last
+            bool outside = false;
+            for (std::size_t i = 0; same && i < sorted.size(); ++i)
+            {
+                uint32_t x, y;
+                bool inside = tile_pixel(TILE, sorted.view().x[i], sorted.view().y[i], x, y);
+                same = !(inside && outside);
+                outside = !inside;
+            }
+            std::cerr << "sorted grid of " << view.size << " rows on " << threads << " threads: "
+                      << (same ? "ok" : "MISMATCH") << std::endl;
+            ok = ok && same;
+
+            // pretend every CPU is in each of two nodes, to go through
+            // the per-node reduction
+            numa_node all = numa_nodes().front();
+            numa_layout layout({ all, all }, threads);
+            thread_pool numa_pool(layout.threads());
+            numa_points partitions(view, numa_pool, layout);
+            numa_arena numa(numa_pool, layout);
+            same = same_grid(numa_grid(partitions, numa_pool, layout, numa), expected, 1e-4f);
+            std::cerr << "numa grid of " << view.size << " rows on " << layout.threads() << " threads: "
+                      << (same ? "ok" : "MISMATCH") << std::endl;
+            ok = ok && same;
+        }
+    }
+    return ok;
+}
+
+/**
+ * checks that --deterministic grids reject amounts and pixel sums past the
+ * fixed point range, and still give exact sums right below it. Returns
+ * false if not.
+ */
+bool check_fixed_range()
+{
+    const float middle_x = (TILE.bbox[0] + TILE.bbox[2]) / 2, middle_y = (TILE.bbox[1] + TILE.bbox[3]) / 2;
+    const float big = std::ldexp(1.0f, 46);
+    struct fixed_case
+    {
+        std::vector<float> values;
+        bool overflow;
+    };
+    const fixed_case cases[] = {
+        { { big / 2, big / 2 }, false },
+        { { big, -big, big }, false },
+        { { big, big }, true },
+        { { 1e30f }, true },
+        { { -1e30f }, true },
+        { { std::nanf("") }, true },
+        { { 1.0f, 2.5f }, false },
+    };
+
+    thread_pool pool(2);
+    fixed_arena fixed(pool.size());
+    bool ok = true;
+    for (const auto& amounts: cases)
+    {
+        std::vector<row> rows(amounts.values.size());
+        for (std::size_t i = 0; i < rows.size(); ++i)
+        {
+            rows[i].x = middle_x;
+            rows[i].y = middle_y;
+            rows[i].amount = amounts.values[i];
+        }
+        point_columns points;
+        points.assign(rows);
+        bool overflow = false;
+        double sum = 0;
+        try
+        {
+            const tile_grid& result = grid(points.view(), pool, fixed);
+            sum = std::accumulate(result.sum.begin(), result.sum.end(), 0.0);
+        }
+        catch (const std::overflow_error&)
+        {
+            overflow = true;
+        }
+        double expected = std::accumulate(amounts.values.begin(), amounts.values.end(), 0.0);
+        bool same = overflow == amounts.overflow && (overflow || sum == expected);
+        std::cerr << "deterministic grid of " << rows.size() << " amounts summing to " << expected << ": "
+                  << (overflow ? "overflow " : "") << (same ? "ok" : "MISMATCH") << std::endl;
+        ok = ok && same;
+    }
+    return ok;
+}
+
+/**
+ * checks that `ramp` gives every value exactly the gray level std::pow
+ * does, over values spread both linearly and by octaves, and that ramps of
+ * other sizes stay within their size or are rejected. Returns false if not.
+ */
+bool check_ramp(const color_ramp& ramp)
+{
+    const int steps = 1 << 20;
+    uint32_t worst = 0;
+    std::size_t off = 0;
+    for (int i = 0; i <= steps; ++i)
+    {
+        float values[] = { float(i) / steps, std::ldexp(1.0f + float(i % 1024) / 1024, -(i / 1024) % 40 - 1) };
+        for (float value: values)
+        {
+            uint32_t level = ramp(value);
+            uint32_t exact = ramp.exact(value);
+            uint32_t error = level > exact ? level - exact : exact - level;
+            worst = std::max(worst, error);
+            off += error != 0;
+        }
+    }
+    bool ok = worst == 0;
+    std::cerr << "color ramp of " << ramp.size() << " entries: " << off << " of " << 2 * (steps + 1)
+              << " levels off by at most " << worst << (ok ? " ok" : " MISMATCH") << std::endl;
+
+    const std::size_t sizes[] = { 0, 2, 24, 25, 26, 48, 49, 1000, color_ramp::max_size, color_ramp::max_size + 1 };
+    for (std::size_t size: sizes)
+    {
+        std::size_t entries = 0;
+        try
+        {
+            entries = color_ramp(0.4f, 15, 255, size).size();
+        }
+        catch (const std::invalid_argument&)
+        {
+        }
+        // 24 octaves at this gamma and these levels
+        bool fits = size < 25 || size > color_ramp::max_size ? entries == 0 : entries > 0 && entries <= size;
+        std::cerr << "color ramp of at most " << size << " entries: " << entries << (fits ? " ok" : " MISMATCH")
+                  << std::endl;
+        ok = fits && ok;
+    }
+    return ok;
+}
+
+/**
+ * deflate bits, least significant first, one at a time
+ */
+struct bit_reader
+{
+    const uint8_t* data;
+    std::size_t size;
+    std::size_t bit;
+
+    uint32_t get(unsigned count)
+    {
+        uint32_t value = 0;
+        for (unsigned i = 0; i < count; ++i, ++bit)
+        {
+            if (bit / 8 >= size)
+            {
+                throw std::runtime_error("truncated deflate stream");
+            }
+            value |= uint32_t((data[bit / 8] >> (bit % 8)) & 1) << i;
+        }
+        return value;
+    }
+};
+
+/**
+ * canonical Huffman code from its lengths, decoded one bit at a time
+ */
+struct huffman_decoder
+{
+    uint32_t count[16];
+    std::vector<uint32_t> symbols;
+
+    huffman_decoder(const uint8_t* lengths, std::size_t n)
+    {
+        std::fill(count, count + 16, 0);
+        for (unsigned length = 1; length < 16; ++length)
+        {
+            for (std::size_t symbol = 0; symbol < n; ++symbol)
+            {
+                if (lengths[symbol] == length)
+                {
+                    ++count[length];
+                    symbols.push_back(uint32_t(symbol));
+                }
+            }
+        }
+    }
+
+    uint32_t decode(bit_reader& in) const
+    {
+        uint32_t code = 0, first = 0, index = 0;
+        for (unsigned length = 1; length < 16; ++length)
+        {
+            code |= in.get(1);
+            if (code - first < count[length])
+            {
+                return symbols[index + code - first];
+            }
+            index += count[length];
+            first = (first + count[length]) << 1;
+            code <<= 1;
+        }
+        throw std::runtime_error("bad Huffman code");
+    }
+};
+
+/**
+ * inflates the stored and dynamic Huffman blocks of a deflate stream
+ */
+std::vector<uint8_t> inflate(const uint8_t* data, std::size_t size)
+{
+    static const uint16_t length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const uint8_t length_bits[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                           3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const uint8_t order[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    std::vector<uint8_t> out;
+    bit_reader in = { data, size, 0 };
+    for (bool last = false; !last; )
+    {
+        last = in.get(1);
+        uint32_t type = in.get(2);
+        if (type == 0)
+        {
+            in.bit = (in.bit + 7) / 8 * 8;
+            uint32_t length = in.get(16);
+            if (in.get(16) != (~length & 0xffff))
+            {
+                throw std::runtime_error("bad stored block");
+            }
+            for (uint32_t i = 0; i < length; ++i)
+            {
+                out.push_back(uint8_t(in.get(8)));
+            }
+            continue;
+        }
+        if (type != 2)
+        {
+            throw std::runtime_error("unexpected deflate block type");
+        }
+
+        uint32_t literals = in.get(5) + 257, distances = in.get(5) + 1, codes = in.get(4) + 4;
+        uint8_t code_lengths[19] = { 0 };
+        for (uint32_t i = 0; i < codes; ++i)
+        {
+            code_lengths[order[i]] = in.get(3);
+        }
+        huffman_decoder length_code(code_lengths, 19);
+        std::vector<uint8_t> lengths;
+        while (lengths.size() < literals + distances)
+        {
+            uint32_t symbol = length_code.decode(in);
+            if (symbol < 16)
+            {
+                lengths.push_back(symbol);
+                continue;
+            }
+            if (symbol == 16 && lengths.empty())
+            {
+                throw std::runtime_error("bad code lengths");
+            }
+            uint8_t length = symbol == 16 ? lengths.back() : 0;
+            uint32_t repeat = symbol == 16 ? 3 + in.get(2) : symbol == 17 ? 3 + in.get(3) : 11 + in.get(7);
+            lengths.insert(lengths.end(), repeat, length);
+        }
+        huffman_decoder literal_code(lengths.data(), literals);
+        huffman_decoder distance_code(lengths.data() + literals, distances);
+        for (;;)
+        {
+            uint32_t symbol = literal_code.decode(in);
+            if (symbol < 256)
+            {
+                out.push_back(uint8_t(symbol));
+                continue;
+            }
+            if (symbol == 256)
+            {
+                break;
+            }
+            if (symbol > 285)
+            {
+                throw std::runtime_error("bad length symbol");
+            }
+            uint32_t length = length_base[symbol - 257] + in.get(length_bits[symbol - 257]);
+            uint32_t distance_symbol = distance_code.decode(in);
+            uint32_t extra = distance_symbol < 4 ? 0 : distance_symbol / 2 - 1;
+            uint32_t distance = (distance_symbol < 4 ? distance_symbol + 1 :
+                                 ((2 + distance_symbol % 2) << extra) + 1) + in.get(extra);
+            if (distance > out.size())
+            {
+                throw std::runtime_error("bad distance");
+            }
+            for (uint32_t i = 0; i < length; ++i)
+            {
+                out.push_back(out[out.size() - distance]);
+            }
+        }
+    }
+    return out;
+}
+
+/**
+ * the pixels of a PNG written by encode_png(), checking its chunks and its
+ * zlib stream. Throws std::runtime_error for anything else.
+ */
+std::vector<uint8_t> decode_png(const std::vector<uint8_t>& png, uint32_t& width, uint32_t& height,
+                                unsigned& channels)
+{
+    auto u32 = [] (const uint8_t* at) {
+        return uint32_t(at[0]) << 24 | uint32_t(at[1]) << 16 | uint32_t(at[2]) << 8 | at[3];
+    };
+    static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    if (png.size() < 8 || !std::equal(signature, signature + 8, png.begin()))
+    {
+        throw std::runtime_error("bad png signature");
+    }
+    std::vector<uint8_t> stream;
+    for (std::size_t at = 8; at < png.size(); )
+    {
+        uint32_t length = u32(&png[at]);
+        if (at + 12 + length > png.size() ||
+            png_detail::crc32(&png[at + 4], length + 4) != u32(&png[at + 8 + length]))
+        {
+            throw std::runtime_error("bad png chunk");
+        }
+        std::string type(png.begin() + at + 4, png.begin() + at + 8);
+        if (type == "IHDR")
+        {
+            width = u32(&png[at + 8]);
+            height = u32(&png[at + 12]);
+            channels = png[at + 17] == 6 ? 4 : 1;
+        }
+        else if (type == "IDAT")
+        {
+            stream.insert(stream.end(), png.begin() + at + 8, png.begin() + at + 8 + length);
+        }
+        at += 12 + length;
+    }
+    if (stream.size() < 6)
+    {
+        throw std::runtime_error("bad zlib stream");
+    }
+    std::vector<uint8_t> raw = inflate(stream.data() + 2, stream.size() - 6);
+    std::size_t stride = std::size_t(width) * channels;
+    if (raw.size() != (stride + 1) * height ||
+        png_detail::adler32(raw.data(), raw.size()) != u32(&stream[stream.size() - 4]))
+    {
+        throw std::runtime_error("bad png data");
+    }
+
+    std::vector<uint8_t> pixels(stride * height);
+    for (uint32_t row = 0; row < height; ++row)
+    {
+        const uint8_t* filtered = &raw[row * (stride + 1)];
+        uint8_t* out = &pixels[row * stride];
+        if (filtered[0] > 1)
+        {
+            throw std::runtime_error("unexpected png filter");
+        }
+        for (std::size_t i = 0; i < stride; ++i)
+        {
+            out[i] = filtered[1 + i] + (filtered[0] == 1 && i >= channels ? out[i - channels] : 0);
+        }
+    }
+    return pixels;
+}
+
+/**
+ * checks that the PNGs of a grid and of an empty one decode to the gray
+ * levels of write_ppm(), and to pixels without points transparent in RGBA,
+ * with every compression. Returns false if they do not.
+ */
+bool check_png(const column_view& points, const color_ramp& ramp)
+{
+    thread_pool pool(2);
+    grid_arena arena(pool.size());
+    const tile_grid grids[] = { grid(points, pool, arena), tile_grid(grid_size) };
+    const uint32_t size = TILE.pixel_resolution;
+    bool ok = true;
+    for (const tile_grid& g: grids)
+    {
+        std::vector<uint8_t> levels(grid_size);
+        gray_levels(g, ramp, levels.data());
+        for (png_compression compression: { png_compression::stored, png_compression::rle })
+        {
+            for (bool rgba: { false, true })
+            {
+                std::vector<uint8_t> png;
+                encode_png(g, ramp, compression, rgba, png);
+                bool same = false;
+                try
+                {
+                    uint32_t width = 0, height = 0;
+                    unsigned channels = 0;
+                    std::vector<uint8_t> pixels = decode_png(png, width, height, channels);
+                    same = width == size && height == size && channels == (rgba ? 4u : 1u);
+                    for (int i = 0; same && i < grid_size; ++i)
+                    {
+                        uint32_t row = i / size, column = i % size;
+                        uint32_t count = g.count[(size - 1 - row) * size + column];
+                        same = pixels[i * channels] == levels[i] &&
+                            (!rgba || pixels[i * 4 + 3] == (count ? 255 : 0));
+                    }
+                }
+                catch (const std::exception& e)
+                {
+                    std::cerr << e.what() << std::endl;
+                }
+                std::cerr << (compression == png_compression::stored ? "stored" : "rle") << (rgba ? " RGBA" : "")
+                          << " png of " << (&g == grids ? "the" : "an empty") << " grid: " << png.size()
+                          << " bytes " << (same ? "ok" : "MISMATCH") << std::endl;
+                ok = ok && same;
+            }
+        }
+    }
+    return ok;
+}
+
+/**
+ * checks that every level of a pyramid binned two zoom levels below the
+ * tile has the counts of grid() at the scale of that level and the same
+ * sums but for float rounding, and that sub tiles cut the finest level
+ * right. Returns false if they do not.
+ */
+bool check_pyramid(const column_view& points)
+{
+    const int levels = 2;
+    const saved_tile saved;
+    const tile_geometry& tile = saved.tile;
+    const int tile_size = saved.size;
+    thread_pool pool(2);
+
+    // the specialized kernels only bin the tile's own size
+    std::vector<tile_grid> direct;
+    for (int level = 0; level <= levels; ++level)
+    {
+        refine_tile(level);
+        column_kernel = bin_scalar<0>;
+        column_lanes = 1;
+        grid_arena arena(pool.size());
+        direct.push_back(grid(points, pool, arena));
+        saved.restore();
+    }
+
+    // the finest level as --pyramid bins it
+    refine_tile(levels);
+    band_arena bands;
+    bool banded = same_grid(band_grid(points, pool, bands), direct.back(), 1e-4f);
+    saved.restore();
+    std::cerr << "pyramid bands of level " << levels << ": " << (banded ? "ok" : "MISMATCH") << std::endl;
+
+    tile_pyramid pyramid(tile.pixel_resolution, levels);
+    build_pyramid(direct.back(), pool, pyramid);
+    bool ok = banded;
+    for (int level = 0; level < levels; ++level)
+    {
+        grid_size = tile_size << (2 * level);
+        bool same = same_grid(pyramid.coarse[level], direct[level], 1e-4f);
+        std::cerr << "pyramid level " << level << " of " << pyramid.level_pixels(level) << " pixels: "
+                  << (same ? "ok" : "MISMATCH") << std::endl;
+        ok = ok && same;
+    }
+
+    grid_size = tile_size;
+    const uint32_t size = tile.pixel_resolution, tiles = 1 << levels;
+    tile_grid sub(tile_size), expected(tile_size);
+    bool same = true;
+    for (uint32_t x = 0; x < tiles; ++x)
+    {
+        for (uint32_t y = 0; y < tiles; ++y)
+        {
+            sub_tile(direct.back(), size * tiles, size, x, y, sub);
+            for (uint32_t px_x = 0; px_x < size; ++px_x)
+            {
+                for (uint32_t px_y = 0; px_y < size; ++px_y)
+                {
+                    std::size_t p = std::size_t(x * size + px_x) * size * tiles + y * size + px_y;
+                    expected.sum[px_x * size + px_y] = direct.back().sum[p];
+                    expected.count[px_x * size + px_y] = direct.back().count[p];
+                    expected.avg[px_x * size + px_y] = direct.back().avg[p];
+                }
+            }
+            same = same && same_grid(sub, expected, 0.0f);
+        }
+    }
+    std::cerr << "pyramid sub tiles of level " << levels << ": " << (same ? "ok" : "MISMATCH") << std::endl;
+
+    // rendered on their own, the sub tiles have float bboxes of their own,
+    // whose edges are up to a float step away from the pyramid's pixel
+    // edges: the points that close to a pixel edge, along either axis, may
+    // land in the neighbouring pixel
+    const int zoom = saved.zoom;
+    const double tile_meters = mercator_tile_size(zoom);
+    const uint32_t tile_x = std::lround((tile.bbox[1] + mercator_extent) / tile_meters);
+    const uint32_t tile_y = std::lround((mercator_extent - tile.bbox[2]) / tile_meters);
+    float edge = 0.0f;
+    for (float coordinate: tile.bbox)
+    {
+        edge = std::max(edge, std::abs(coordinate));
+    }
+    const double step = std::nextafter(edge, INFINITY) - edge;
+    const double bound = 2 * step / (mercator_tile_size(zoom + levels) / size);
+    std::size_t moved = 0, binned = 0;
+    column_kernel = bin_scalar<0>;
+    column_lanes = 1;
+    for (uint32_t x = 0; x < tiles; ++x)
+    {
+        for (uint32_t y = 0; y < tiles; ++y)
+        {
+            sub_tile(direct.back(), size * tiles, size, x, y, sub);
+            // as in write_pyramid()
+            set_tile(std::to_string(zoom + levels) + "/" + std::to_string((tile_x << levels) + y) + "/" +
+                     std::to_string((tile_y << levels) + tiles - 1 - x), size);
+            grid_arena arena(pool.size());
+            const tile_grid& own = grid(points, pool, arena);
+            for (int p = 0; p < tile_size; ++p)
+            {
+                moved += std::abs(int64_t(sub.count[p]) - int64_t(own.count[p]));
+                binned += own.count[p];
+            }
+        }
+    }
+    // every moved point leaves one pixel and enters another
+    double fraction = binned ? moved / 2.0 / binned : 0.0;
+    bool close = binned > 0 && fraction <= bound;
+    std::cerr << "pyramid sub tiles of level " << levels << " against their own tiles: " << 100 * fraction
+              << "% of the points moved, at most " << 100 * bound << "%: " << (close ? "ok" : "MISMATCH")
+              << std::endl;
+    return ok && same && close;
+}
+
+/**
+ * checks that batch_grid() gives the 4x4 tiles two zoom levels below the
+ * default one, plus a tile without points, the grids of rendering each of
+ * them alone. Returns false if it does not.
+ */
+bool check_batch(const column_view& points)
+{
+    const saved_tile saved;
+    thread_pool pool(2);
+
+    std::vector<std::string> list = { "12/0/0" };
+    for (uint32_t x = BBOX_X * 4; x < BBOX_X * 4 + 4; ++x)
+    {
+        for (uint32_t y = BBOX_Y * 4; y < BBOX_Y * 4 + 4; ++y)
+        {
+            list.push_back("12/" + std::to_string(x) + "/" + std::to_string(y));
+        }
+    }
+    // listed twice, rendered once
+    list.push_back(list.back());
+    tile_batch batch(list, pixel_resolution);
+    batch_grid(points, pool, batch);
+
+    bool ok = batch.size() == list.size() - 1;
+    column_kernel = bin_scalar<0>;
+    column_lanes = 1;
+    std::size_t binned = 0;
+    for (std::size_t slot = 0; slot < batch.size(); ++slot)
+    {
+        set_tile("12/" + std::to_string(batch.xs[slot]) + "/" + std::to_string(batch.ys[slot]), pixel_resolution);
+        grid_arena arena(pool.size());
+        ok = same_grid(batch.grids[slot], grid(points, pool, arena), 1e-4f) && ok;
+        binned += std::accumulate(batch.grids[slot].count.begin(), batch.grids[slot].count.end(), std::size_t(0));
+    }
+    // the tiles under the default one are not empty
+    ok = ok && binned > 0;
+    std::cerr << "batch of " << batch.size() << " tiles: " << (ok ? "ok" : "MISMATCH") << std::endl;
+    return ok;
+}
+
+/**
+ * checks that rendering the default tile by its coordinates, BBOX_ZOOM /
+ * BBOX_X / BBOX_Y, bins every point in the same pixel as the default bbox.
+ * Returns false if it does not.
+ */
+bool check_tile(const column_view& points)
+{
+    const saved_tile saved;
+    thread_pool pool(2);
+
+    set_tile("", pixel_resolution);
+    grid_arena arena(pool.size());
+    tile_grid expected = grid(points, pool, arena);
+    set_tile(std::to_string(BBOX_ZOOM) + "/" + std::to_string(BBOX_X) + "/" + std::to_string(BBOX_Y),
+             pixel_resolution);
+    bool ok = same_grid(grid(points, pool, arena), expected, 1e-4f) && expected.max_sum > 0;
+    std::cerr << "tile " << BBOX_ZOOM << "/" << BBOX_X << "/" << BBOX_Y << " as the default tile: "
+              << (ok ? "ok" : "MISMATCH") << std::endl;
+    return ok;
+}
+
+/**
+ * checks that, once warmed up, grid() does not allocate any memory.
+ * Returns false if it does.
+ */
+bool check_allocations(const column_view& points)
+{
+    std::vector<row> rows(points.size);
+    for (std::size_t i = 0; i < points.size; ++i)
+    {
+        rows[i].x = points.x[i];
+        rows[i].y = points.y[i];
+        rows[i].amount = points.amount[i];
+    }
+    thread_pool pool(2);
+    grid_arena arena(pool.size());
+    grid(points, pool, arena);
+    grid(rows, pool, arena);
+
+    std::size_t before = allocations.load();
+    for (int i = 0; i < 3; i++)
+    {
+        grid(points, pool, arena);
+        grid(rows, pool, arena);
+    }
+    std::size_t count = allocations.load() - before;
+    std::cerr << "allocations in grid(): " << count << (count ? " MISMATCH" : " ok") << std::endl;
+    return count == 0;
+}
+
+int main (int argc, char** argv)
+{
+    std::string kernel = "auto";
+    std::string tile;
+    uint32_t pixels = pixel_resolution;
+    const char* filename = nullptr;
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg == "--kernel" && i + 1 < argc)
+            {
+                kernel = argv[++i];
+            }
+            else if (arg == "--tile" && i + 1 < argc)
+            {
+                tile = argv[++i];
+            }
+            else if (arg == "--resolution" && i + 1 < argc)
+            {
+                pixels = std::stoul(argv[++i]);
+            }
+            else if (arg.compare(0, 2, "--") == 0 || filename)
+            {
+                filename = nullptr;
+                break;
+            }
+            else
+            {
+                filename = argv[i];
+            }
+        }
+    }
+    catch (const std::logic_error&)
+    {
+        filename = nullptr;
+    }
+    if (!filename || pixels < 1 || pixels > 4096)
+    {
+        std::cerr << argv[0] << " [--kernel NAME] [--tile Z/X/Y] [--resolution N] file.csv" << std::endl;
+        exit(-1);
+    }
+
+    try
+    {
+        set_tile(tile, pixels);
+        kernel_info info = find_bin_kernel(kernel, TILE.pixel_resolution);
+        if (!info.fn)
+        {
+            throw std::invalid_argument("kernel " + kernel + " is not available on this CPU");
+        }
+        column_kernel = info.fn;
+        column_lanes = info.lanes;
+        color_ramp ramp(0.4f, 15, 255);
+
+        point_columns columns;
+        read(columns, filename);
+        bool ok = check_kernels(columns.view());
+        ok = check_edges() && ok;
+        ok = check_grid(columns.view()) && ok;
+        ok = check_allocations(columns.view()) && ok;
+        ok = check_fixed_range() && ok;
+        ok = check_ramp(ramp) && ok;
+        ok = check_png(columns.view(), ramp) && ok;
+        ok = check_pyramid(columns.view()) && ok;
+        ok = check_batch(columns.view()) && ok;
+        ok = check_tile(columns.view()) && ok;
+        return ok ? 0 : 1;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        exit(-1);
+    }
+}
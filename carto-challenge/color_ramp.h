@@ -0,0 +1,128 @@
+/*
+ * Gray ramp for rendering normalized pixel values: level low + (high - low)
+ * * value^gamma, through a lookup table instead of a pow() per pixel.
+ *
+ * The table is indexed by the top bits of the float value, i.e. by its
+ * octave and the first bits of its mantissa, so that buckets are narrow
+ * near 0 where value^gamma is steep. Octaves low enough to map to `low`
+ * anyway all go to the first entry. Every entry holds the level at the
+ * start of its bucket and the first value of the bucket reaching the next
+ * level: as long as no bucket spans more than one level, which the default
+ * 4096 entries ensure, the ramp gives exactly the levels std::pow does.
+ */
+
+#ifndef CARTO_COLOR_RAMP_H
+#define CARTO_COLOR_RAMP_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class color_ramp
+{
+public:
+    /** largest table a ramp takes */
+    static const std::size_t max_size = std::size_t(1) << 20;
+
+    /**
+     * ramp from `low` to `high` (at most 255) along value^gamma, with a
+     * table of at most `size` entries. Throws std::invalid_argument for
+     * bad parameters, or a size below one entry per octave the ramp spans
+     * or above max_size.
+     */
+    color_ramp(float gamma, uint32_t low, uint32_t high, std::size_t size = 4096):
+        _gamma(gamma), _low(low), _high(high)
+    {
+        if (!(gamma > 0.0f) || low >= high || high > 255)
+        {
+            throw std::invalid_argument("bad color ramp");
+        }
+        // below 2^-octaves, value^gamma * (high - low) < 0.5
+        int octaves = std::min(126, int(std::ceil(std::log2(2.0 * (high - low)) / gamma)) + 1);
+        // one entry per octave and one for 1
+        if (size < std::size_t(octaves) + 1 || size > max_size)
+        {
+            throw std::invalid_argument("color ramp needs " + std::to_string(octaves + 1) + " to " +
+                                        std::to_string(max_size) + " entries");
+        }
+        int mantissa_bits = 0;
+        while (mantissa_bits < 23 && (std::size_t(octaves) << (mantissa_bits + 1)) + 1 <= size)
+        {
+            ++mantissa_bits;
+        }
+        _shift = 23 - mantissa_bits;
+        _base = (127 - octaves) << mantissa_bits;
+        _last = octaves << mantissa_bits;
+
+        _levels.resize(_last + 1);
+        _steps.resize(_last + 1);
+        for (int32_t i = 0; i <= _last; ++i)
+        {
+            // values go to the first bucket from 0 on, and 1 has its own
+            uint32_t first = i ? uint32_t(i + _base) << _shift : 0;
+            uint32_t end = i < _last ? uint32_t(i + 1 + _base) << _shift : first + 1;
+            _levels[i] = exact(as_float(first));
+            // binary search for the first value of the next level
+            while (first < end)
+            {
+                uint32_t middle = first + (end - first) / 2;
+                if (exact(as_float(middle)) > _levels[i])
+                {
+                    end = middle;
+                }
+                else
+                {
+                    first = middle + 1;
+                }
+            }
+            _steps[i] = i < _last ? as_float(end) : 2.0f;
+        }
+    }
+
+    std::size_t size() const { return _levels.size(); }
+
+    /**
+     * gray level of `value`, clamped to [0, 1]. NaN is 0.
+     */
+    uint32_t operator()(float value) const
+    {
+        value = value > 0.0f ? std::min(value, 1.0f) : 0.0f;
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        int32_t index = std::min(std::max(int32_t(bits >> _shift) - _base, 0), _last);
+        return _levels[index] + (value >= _steps[index]);
+    }
+
+    /**
+     * gray level of `value` with std::pow, which the table approximates
+     */
+    uint32_t exact(float value) const
+    {
+        value = value > 0.0f ? std::min(value, 1.0f) : 0.0f;
+        return _low + uint32_t(std::pow(value, _gamma) * float(_high - _low));
+    }
+
+private:
+    static float as_float(uint32_t bits)
+    {
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    float _gamma;
+    uint32_t _low;
+    uint32_t _high;
+    uint32_t _shift;
+    int32_t _base;
+    int32_t _last;
+    // level at the start of every bucket, and where the next one starts
+    std::vector<uint8_t> _levels;
+    std::vector<float> _steps;
+};
+
+#endif
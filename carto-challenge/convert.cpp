@@ -0,0 +1,47 @@
+/*
+ * Converts a point dump to the binary columnar format read by torque and
+ * torque-mod, so that it does not have to be parsed again on every run.
+ *
+ * execute with:
+ *   # ./torque-convert tile.csv tile.bin
+ */
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "csv.h"
+#include "points_file.h"
+
+using std::chrono::high_resolution_clock;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+
+int main (int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << argv[0] << " file.csv file.bin" << std::endl;
+        exit(-1);
+    }
+
+    try
+    {
+        high_resolution_clock::time_point t1 = high_resolution_clock::now();
+        std::vector<row> rows;
+        read(rows, argv[1]);
+        high_resolution_clock::time_point t2 = high_resolution_clock::now();
+        points_file::write(rows, argv[2]);
+        high_resolution_clock::time_point t3 = high_resolution_clock::now();
+
+        std::cerr << "Converted " << rows.size() << " rows" << std::endl;
+        std::cerr << "Read: " << duration_cast<milliseconds>(t2 - t1).count() << "ms" << std::endl;
+        std::cerr << "Write: " << duration_cast<milliseconds>(t3 - t2).count() << "ms" << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        exit(-1);
+    }
+    return 0;
+}
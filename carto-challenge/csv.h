@@ -0,0 +1,400 @@
+/*
+ * Zero-copy parser for the space separated point dumps:
+ *
+ *   amount y x
+ *
+ * Rows are parsed straight from the mapped file bytes, without building a
+ * std::string per line. The float parser gives the same values as strtof()
+ * (and hence as istringstream and sscanf): the common short decimals are
+ * converted exactly through a double, anything else falls back to strtof().
+ */
+
+#ifndef CARTO_CSV_H
+#define CARTO_CSV_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "mapped_file.h"
+#include "points.h"
+#include "points_file.h"
+
+namespace csv
+{
+    inline bool is_blank(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    inline bool is_digit(char c)
+    {
+        return unsigned(c - '0') < 10;
+    }
+
+    /**
+     * slow path: copies the token into a null terminated buffer for strtof()
+     */
+    inline const char* parse_float_slow(const char* begin, const char* end, float& out)
+    {
+        char buf[128];
+        std::size_t len = std::min<std::size_t>(end - begin, sizeof(buf) - 1);
+        std::memcpy(buf, begin, len);
+        buf[len] = '\0';
+        char* stop;
+        out = std::strtof(buf, &stop);
+        return stop == buf ? nullptr : begin + (stop - buf);
+    }
+
+    /**
+     * parses a float at `p`, returning the position right after it or
+     * nullptr if there is no number there
+     */
+    inline const char* parse_float(const char* p, const char* end, float& out)
+    {
+        static const double pow10[] = {
+            1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        const char* start = p;
+        bool negative = false;
+        if (p != end && (*p == '-' || *p == '+'))
+        {
+            negative = *p == '-';
+            ++p;
+        }
+
+        uint64_t mantissa = 0;
+        int digits = 0;
+        int exponent = 0;
+        bool any = false;
+        for (; p != end && is_digit(*p); ++p, any = true)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+            }
+            else
+            {
+                ++exponent;
+            }
+        }
+        if (p != end && *p == '.')
+        {
+            for (++p; p != end && is_digit(*p); ++p, any = true)
+            {
+                if (digits < 19)
+                {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    digits += mantissa != 0;
+                    --exponent;
+                }
+            }
+        }
+        if (!any)
+        {
+            return nullptr;
+        }
+        if (p != end && (*p == 'e' || *p == 'E'))
+        {
+            // anything fancy in the exponent is left to strtof
+            return parse_float_slow(start, end, out);
+        }
+
+        // Clinger's fast path: both the mantissa and the power of ten are
+        // exact doubles, so the single operation below is correctly rounded
+        if (digits > 15 || exponent < -22 || exponent > 22)
+        {
+            return parse_float_slow(start, end, out);
+        }
+        double value = double(mantissa);
+        value = exponent < 0 ? value / pow10[-exponent] : value * pow10[exponent];
+
+        // rounding the double again to float can only differ from rounding
+        // the decimal directly when the double falls on a float tie
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        if ((bits & ((uint64_t(1) << 29) - 1)) == (uint64_t(1) << 28))
+        {
+            return parse_float_slow(start, end, out);
+        }
+
+        out = float(negative ? -value : value);
+        return p;
+    }
+
+    /**
+     * parses a `amount y x` line at `p`, leaving `p` at the start of the next
+     * line. Returns false if the line does not start with three numbers.
+     */
+    inline bool parse_row(const char*& p, const char* end, row& r)
+    {
+        const char* q = p;
+        float* fields[] = { &r.amount, &r.y, &r.x };
+        for (float* field: fields)
+        {
+            while (q != end && is_blank(*q))
+            {
+                ++q;
+            }
+            q = parse_float(q, end, *field);
+            if (!q)
+            {
+                return false;
+            }
+        }
+        const char* eol = static_cast<const char*>(std::memchr(q, '\n', end - q));
+        p = eol ? eol + 1 : end;
+        return true;
+    }
+
+    /**
+     * parses every row in [begin, end), which must start at a line boundary,
+     * calling `sink(const row&)` for each one. Stops at the first malformed
+     * line, as reading with an istringstream does.
+     */
+    template <typename Sink>
+    const char* parse_rows(const char* begin, const char* end, Sink&& sink)
+    {
+        const char* p = begin;
+        row r;
+        while (p != end && parse_row(p, end, r))
+        {
+            sink(r);
+        }
+        return p;
+    }
+
+    inline std::size_t count_lines(const char* begin, const char* end)
+    {
+        std::size_t lines = 0;
+        for (const char* p = begin; p != end; ++lines)
+        {
+            const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            p = eol ? eol + 1 : end;
+        }
+        return lines;
+    }
+
+    /**
+     * moves `p` forward to the first line starting at or after it
+     */
+    inline const char* align_to_line(const char* p, const char* begin, const char* end)
+    {
+        if (p == begin || p == end || p[-1] == '\n')
+        {
+            return p;
+        }
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        return eol ? eol + 1 : end;
+    }
+
+    /**
+     * splits [begin, end) into at most `n` ranges starting at line boundaries,
+     * returning the n + 1 boundaries (some ranges may be empty)
+     */
+    inline std::vector<const char*> split_lines(const char* begin, const char* end, std::size_t n)
+    {
+        std::vector<const char*> bounds(n + 1);
+        bounds[0] = begin;
+        bounds[n] = end;
+        for (std::size_t i = 1; i < n; ++i)
+        {
+            bounds[i] = align_to_line(begin + (end - begin) * i / n, begin, end);
+        }
+        return bounds;
+    }
+
+    /**
+     * runs `fn(i)` for i in [0, n), each call on its own thread
+     */
+    template <typename Fn>
+    void run_parallel(std::size_t n, Fn fn)
+    {
+        std::vector<std::thread> workers;
+        for (std::size_t i = 1; i < n; ++i)
+        {
+            workers.emplace_back(fn, i);
+        }
+        fn(0);
+        for (auto& worker: workers)
+        {
+            worker.join();
+        }
+    }
+
+    // don't bother splitting files into chunks smaller than this
+    const std::size_t min_chunk_size = 1 << 20;
+
+    inline unsigned default_threads(unsigned threads)
+    {
+        return threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    inline void store(std::vector<row>& rows, std::size_t i, const row& r)
+    {
+        rows[i] = r;
+    }
+
+    inline void store(point_columns& points, std::size_t i, const row& r)
+    {
+        points.set(i, r);
+    }
+
+    /**
+     * parses the text of `file` into `points` (a row vector or point columns),
+     * appending to what it already holds.
+     *
+     * The file is split in newline aligned chunks that are parsed by `threads`
+     * threads. Each thread counts the lines of its chunk first, so that it can
+     * then parse straight into its slice of `points`.
+     */
+    template <typename Points>
+    void parse_file(const mapped_file& file, Points& points, unsigned threads)
+    {
+        std::size_t chunks = std::max<std::size_t>(1, std::min<std::size_t>(threads, file.size() / min_chunk_size));
+        auto bounds = split_lines(file.data(), file.end(), chunks);
+
+        std::vector<std::size_t> lines(chunks);
+        run_parallel(chunks, [&] (std::size_t i) {
+            lines[i] = count_lines(bounds[i], bounds[i + 1]);
+        });
+
+        std::vector<std::size_t> offsets(chunks + 1, points.size());
+        for (std::size_t i = 0; i < chunks; ++i)
+        {
+            offsets[i + 1] = offsets[i] + lines[i];
+        }
+        points.resize(offsets[chunks]);
+
+        std::vector<std::size_t> parsed(chunks);
+        run_parallel(chunks, [&] (std::size_t i) {
+            std::size_t out = offsets[i];
+            parse_rows(bounds[i], bounds[i + 1], [&] (const row& r) { store(points, out++, r); });
+            parsed[i] = out - offsets[i];
+        });
+
+        // like the serial reader, drop everything after the first malformed line
+        for (std::size_t i = 0; i < chunks; ++i)
+        {
+            if (parsed[i] < lines[i])
+            {
+                points.resize(offsets[i] + parsed[i]);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * reads a CSV file (well, space separated values) with this format:
+ * amount y x
+ *
+ * The file is parsed by `threads` threads (all hardware threads if 0).
+ * Binary points files written by torque-convert are detected and their
+ * columns are copied in without any parsing.
+ */
+inline void read(std::vector<row>& rows, const char* filename, unsigned threads = 0)
+{
+    mapped_file file(filename);
+    threads = csv::default_threads(threads);
+
+    if (points_file::is_points_file(file))
+    {
+        auto columns = points_file::open(file).columns;
+        std::size_t base = rows.size();
+        rows.resize(base + columns.size);
+        std::size_t chunks = std::max<std::size_t>(1, std::min<std::size_t>(threads, file.size() / csv::min_chunk_size));
+        csv::run_parallel(chunks, [&] (std::size_t c) {
+            std::size_t end = columns.size * (c + 1) / chunks;
+            for (std::size_t i = columns.size * c / chunks; i < end; ++i)
+            {
+                row& r = rows[base + i];
+                r.x = columns.x[i];
+                r.y = columns.y[i];
+                r.amount = columns.amount[i];
+            }
+        });
+        return;
+    }
+
+    csv::parse_file(file, rows, threads);
+}
+
+/**
+ * reads a CSV or points file into columns. Points files are not copied:
+ * `points` borrows the columns of the mapped file and keeps it mapped.
+ */
+inline void read(point_columns& points, const char* filename, unsigned threads = 0)
+{
+    std::shared_ptr<mapped_file> file = std::make_shared<mapped_file>(filename);
+    if (points_file::is_points_file(*file))
+    {
+        points.borrow(points_file::open(*file).columns, file);
+        return;
+    }
+    points.resize(0);
+    csv::parse_file(*file, points, csv::default_threads(threads));
+}
+
+/**
+ * streams the rows of a CSV or points file in batches of at most
+ * `batch_size` rows, calling `fn(worker, begin, end)` concurrently from
+ * `threads` threads (all hardware threads if 0), where `worker` is the index
+ * of the calling thread. Each thread only keeps its current batch in memory,
+ * and the mapped input pages can be evicted as they are consumed.
+ *
+ * Unlike read(), a malformed line only ends the chunk it is found in, as the
+ * rows in later chunks may already have been handed out.
+ */
+template <typename Fn>
+void read_batches(const char* filename, std::size_t batch_size, unsigned threads, Fn fn)
+{
+    mapped_file file(filename);
+    threads = csv::default_threads(threads);
+    std::size_t chunks = std::max<std::size_t>(1, std::min<std::size_t>(threads, file.size() / csv::min_chunk_size));
+
+    if (points_file::is_points_file(file))
+    {
+        auto columns = points_file::open(file).columns;
+        csv::run_parallel(chunks, [&] (std::size_t c) {
+            std::vector<row> batch(batch_size);
+            std::size_t end = columns.size * (c + 1) / chunks;
+            for (std::size_t i = columns.size * c / chunks; i < end; i += batch_size)
+            {
+                std::size_t n = std::min(batch_size, end - i);
+                for (std::size_t j = 0; j < n; ++j)
+                {
+                    batch[j].x = columns.x[i + j];
+                    batch[j].y = columns.y[i + j];
+                    batch[j].amount = columns.amount[i + j];
+                }
+                fn(c, batch.data(), batch.data() + n);
+            }
+        });
+        return;
+    }
+
+    auto bounds = csv::split_lines(file.data(), file.end(), chunks);
+    csv::run_parallel(chunks, [&] (std::size_t c) {
+        std::vector<row> batch(batch_size);
+        std::size_t n = 0;
+        csv::parse_rows(bounds[c], bounds[c + 1], [&] (const row& r) {
+            batch[n++] = r;
+            if (n == batch_size)
+            {
+                fn(c, batch.data(), batch.data() + n);
+                n = 0;
+            }
+        });
+        fn(c, batch.data(), batch.data() + n);
+    });
+}
+
+#endif
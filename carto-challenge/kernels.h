@@ -0,0 +1,389 @@
+/*
+ * Binning kernels for torque-mod: add the points of some column range that
+ * fall inside the tile bbox to a (not yet normalized) histogram.
+ *
+ * Every kernel gives bit-identical histograms: pixel coordinates are computed
+ * with the same float operations, and each pixel receives its amounts in
+ * point order. The vector kernels only differ from the scalar one in doing
+ * the bbox test and the index computation several points at a time.
+ *
+ * Kernels are templates on the tile size in pixels, 0 meaning any size: the
+ * ones for 256x256 tiles turn the pixel index multiplication into a shift.
+ */
+
+#ifndef CARTO_KERNELS_H
+#define CARTO_KERNELS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CARTO_X86 1
+#endif
+
+#include "points.h"
+
+/**
+ * where a kernel adds its points: sum and count of every pixel, in separate
+ * arrays
+ */
+struct histogram_ref
+{
+    float* sum;
+    uint32_t* count;
+};
+
+/**
+ * a (not yet normalized) histogram, as separate sum and count arrays so that
+ * passes over every pixel run over plain vectors of floats and integers
+ */
+struct histogram
+{
+    std::vector<float, aligned_allocator<float>> sum;
+    std::vector<uint32_t, aligned_allocator<uint32_t>> count;
+
+    histogram() {}
+
+    explicit histogram(std::size_t size):
+        sum(size), count(size)
+    {}
+
+    std::size_t size() const { return sum.size(); }
+
+    void resize(std::size_t size)
+    {
+        sum.resize(size);
+        count.resize(size);
+    }
+
+    histogram_ref ref() { return { sum.data(), count.data() }; }
+};
+
+/**
+ * what the kernels need to know about the tile being rendered
+ */
+struct tile_geometry
+{
+    // min x, min y, max x, max y
+    float bbox[4];
+    // pixels per meter
+    float resolution_inv;
+    // tile size in pixels
+    uint32_t pixel_resolution;
+};
+
+typedef void (*bin_kernel)(const tile_geometry& tile, const column_view& points,
+                           std::size_t begin, std::size_t end, histogram_ref hist);
+
+/**
+ * tells whether (x, y) is inside `tile` and, if so, sets `px_x` and `px_y`
+ * to its pixel, with the same float operations as the kernels. A point just
+ * inside the max edge can round up to the tile size, so pixels are clamped
+ * to the last one.
+ */
+inline bool tile_pixel(const tile_geometry& tile, float x, float y, uint32_t& px_x, uint32_t& px_y)
+{
+    const float* bbox = tile.bbox;
+    if (x > bbox[0] && x < bbox[2] && y > bbox[1] && y < bbox[3])
+    {
+        px_x = std::min<uint32_t>(tile.resolution_inv * (x - bbox[0]), tile.pixel_resolution - 1);
+        px_y = std::min<uint32_t>(tile.resolution_inv * (y - bbox[1]), tile.pixel_resolution - 1);
+        return true;
+    }
+    return false;
+}
+
+template <uint32_t Resolution>
+inline void bin_scalar(const tile_geometry& tile, const column_view& points,
+                       std::size_t begin, std::size_t end, histogram_ref hist)
+{
+    const uint32_t resolution = Resolution ? Resolution : tile.pixel_resolution;
+    const float* bbox = tile.bbox;
+    for (std::size_t i = begin; i != end; ++i)
+    {
+        float px_x = points.x[i];
+        float px_y = points.y[i];
+        if (px_x > bbox[0] && px_x < bbox[2] && px_y > bbox[1] && px_y < bbox[3])
+        {
+            // clamped like in tile_pixel()
+            uint32_t x = std::min<uint32_t>(tile.resolution_inv * (px_x - bbox[0]), resolution - 1);
+            uint32_t y = std::min<uint32_t>(tile.resolution_inv * (px_y - bbox[1]), resolution - 1);
+            uint32_t p = x * resolution + y;
+            ++hist.count[p];
+            hist.sum[p] += points.amount[i];
+        }
+    }
+}
+
+#ifdef CARTO_X86
+
+/**
+ * 8 points at a time: compare masks for the bbox test, cvttps for the pixel
+ * coordinates, and a scalar scatter-add over the lanes that passed
+ */
+template <uint32_t Resolution>
+__attribute__((target("avx2")))
+inline void bin_avx2(const tile_geometry& tile, const column_view& points,
+                     std::size_t begin, std::size_t end, histogram_ref hist)
+{
+    const __m256 min_x = _mm256_set1_ps(tile.bbox[0]);
+    const __m256 min_y = _mm256_set1_ps(tile.bbox[1]);
+    const __m256 max_x = _mm256_set1_ps(tile.bbox[2]);
+    const __m256 max_y = _mm256_set1_ps(tile.bbox[3]);
+    const __m256 inv = _mm256_set1_ps(tile.resolution_inv);
+    const uint32_t resolution = Resolution ? Resolution : tile.pixel_resolution;
+    const __m256i stride = _mm256_set1_epi32(resolution);
+    const __m256i last = _mm256_set1_epi32(resolution - 1);
+    alignas(32) uint32_t index[8];
+
+    std::size_t i = begin;
+    for (; i + 8 <= end; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(points.x + i);
+        __m256 y = _mm256_loadu_ps(points.y + i);
+        __m256 inside = _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(x, min_x, _CMP_GT_OQ), _mm256_cmp_ps(x, max_x, _CMP_LT_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(y, min_y, _CMP_GT_OQ), _mm256_cmp_ps(y, max_y, _CMP_LT_OQ)));
+        unsigned mask = _mm256_movemask_ps(inside);
+        if (!mask)
+        {
+            continue;
+        }
+        __m256i px_x = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(inv, _mm256_sub_ps(x, min_x))), last);
+        __m256i px_y = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(inv, _mm256_sub_ps(y, min_y))), last);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(index),
+                           _mm256_add_epi32(_mm256_mullo_epi32(px_x, stride), px_y));
+        for (; mask; mask &= mask - 1)
+        {
+            unsigned lane = __builtin_ctz(mask);
+            ++hist.count[index[lane]];
+            hist.sum[index[lane]] += points.amount[i + lane];
+        }
+    }
+    bin_scalar<Resolution>(tile, points, i, end, hist);
+}
+
+/**
+ * same as bin_avx2, 16 points at a time with mask registers
+ */
+template <uint32_t Resolution>
+__attribute__((target("avx512f")))
+inline void bin_avx512(const tile_geometry& tile, const column_view& points,
+                       std::size_t begin, std::size_t end, histogram_ref hist)
+{
+    const __m512 min_x = _mm512_set1_ps(tile.bbox[0]);
+    const __m512 min_y = _mm512_set1_ps(tile.bbox[1]);
+    const __m512 max_x = _mm512_set1_ps(tile.bbox[2]);
+    const __m512 max_y = _mm512_set1_ps(tile.bbox[3]);
+    const __m512 inv = _mm512_set1_ps(tile.resolution_inv);
+    const uint32_t resolution = Resolution ? Resolution : tile.pixel_resolution;
+    const __m512i stride = _mm512_set1_epi32(resolution);
+    const __m512i last = _mm512_set1_epi32(resolution - 1);
+    alignas(64) uint32_t index[16];
+
+    std::size_t i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+        __m512 x = _mm512_loadu_ps(points.x + i);
+        __m512 y = _mm512_loadu_ps(points.y + i);
+        __mmask16 inside = _mm512_cmp_ps_mask(x, min_x, _CMP_GT_OQ);
+        inside = _mm512_mask_cmp_ps_mask(inside, x, max_x, _CMP_LT_OQ);
+        inside = _mm512_mask_cmp_ps_mask(inside, y, min_y, _CMP_GT_OQ);
+        inside = _mm512_mask_cmp_ps_mask(inside, y, max_y, _CMP_LT_OQ);
+        unsigned mask = inside;
+        if (!mask)
+        {
+            continue;
+        }
+        __m512i px_x = _mm512_min_epi32(_mm512_cvttps_epi32(_mm512_mul_ps(inv, _mm512_sub_ps(x, min_x))), last);
+        __m512i px_y = _mm512_min_epi32(_mm512_cvttps_epi32(_mm512_mul_ps(inv, _mm512_sub_ps(y, min_y))), last);
+        _mm512_store_si512(index, _mm512_add_epi32(_mm512_mullo_epi32(px_x, stride), px_y));
+        for (; mask; mask &= mask - 1)
+        {
+            unsigned lane = __builtin_ctz(mask);
+            ++hist.count[index[lane]];
+            hist.sum[index[lane]] += points.amount[i + lane];
+        }
+    }
+    bin_scalar<Resolution>(tile, points, i, end, hist);
+}
+
+/**
+ * conflict-free vector scatter: lanes hitting the same pixel are found with
+ * vpconflictd, and each round gathers, adds and scatters back only the
+ * first pending lane of every pixel. Later lanes of a pixel go in later
+ * rounds, so amounts are still added in point order.
+ */
+template <uint32_t Resolution>
+__attribute__((target("avx512f,avx512cd")))
+inline void bin_avx512cd(const tile_geometry& tile, const column_view& points,
+                         std::size_t begin, std::size_t end, histogram_ref hist)
+{
+    const __m512 min_x = _mm512_set1_ps(tile.bbox[0]);
+    const __m512 min_y = _mm512_set1_ps(tile.bbox[1]);
+    const __m512 max_x = _mm512_set1_ps(tile.bbox[2]);
+    const __m512 max_y = _mm512_set1_ps(tile.bbox[3]);
+    const __m512 inv = _mm512_set1_ps(tile.resolution_inv);
+    const uint32_t resolution = Resolution ? Resolution : tile.pixel_resolution;
+    const __m512i stride = _mm512_set1_epi32(resolution);
+    const __m512i last = _mm512_set1_epi32(resolution - 1);
+    const __m512i one = _mm512_set1_epi32(1);
+    float* sums = hist.sum;
+    int* counts = reinterpret_cast<int*>(hist.count);
+
+    std::size_t i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+        __m512 x = _mm512_loadu_ps(points.x + i);
+        __m512 y = _mm512_loadu_ps(points.y + i);
+        __mmask16 pending = _mm512_cmp_ps_mask(x, min_x, _CMP_GT_OQ);
+        pending = _mm512_mask_cmp_ps_mask(pending, x, max_x, _CMP_LT_OQ);
+        pending = _mm512_mask_cmp_ps_mask(pending, y, min_y, _CMP_GT_OQ);
+        pending = _mm512_mask_cmp_ps_mask(pending, y, max_y, _CMP_LT_OQ);
+        if (!pending)
+        {
+            continue;
+        }
+        __m512i px_x = _mm512_min_epi32(_mm512_cvttps_epi32(_mm512_mul_ps(inv, _mm512_sub_ps(x, min_x))), last);
+        __m512i px_y = _mm512_min_epi32(_mm512_cvttps_epi32(_mm512_mul_ps(inv, _mm512_sub_ps(y, min_y))), last);
+        __m512i index = _mm512_add_epi32(_mm512_mullo_epi32(px_x, stride), px_y);
+        __m512 amount = _mm512_loadu_ps(points.amount + i);
+        // bit j of lane k is set if lane j < k has the same index
+        __m512i conflicts = _mm512_conflict_epi32(index);
+
+        while (pending)
+        {
+            __m512i earlier = _mm512_and_si512(conflicts, _mm512_set1_epi32(pending));
+            __mmask16 ready = _mm512_mask_testn_epi32_mask(pending, earlier, earlier);
+            __m512 sum = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), ready, index, sums, 4);
+            __m512i count = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), ready, index, counts, 4);
+            _mm512_mask_i32scatter_ps(sums, ready, index, _mm512_add_ps(sum, amount), 4);
+            _mm512_mask_i32scatter_epi32(counts, ready, index, _mm512_add_epi32(count, one), 4);
+            pending &= ~ready;
+        }
+    }
+    bin_scalar<Resolution>(tile, points, i, end, hist);
+}
+
+// number of sub-histograms used by bin_avx2_lanes
+const std::size_t bin_lanes = 4;
+
+/**
+ * like bin_avx2, but lane k scatters into sub-histogram k % bin_lanes, so
+ * that neighbouring points hitting the same pixel do not wait on each other.
+ * `hist` holds the bin_lanes sub-histograms one after the other, and whoever
+ * merges it adds them up, which changes the order in which sums are added:
+ * results match the other kernels up to float rounding only.
+ */
+template <uint32_t Resolution>
+__attribute__((target("avx2")))
+inline void bin_avx2_lanes(const tile_geometry& tile, const column_view& points,
+                           std::size_t begin, std::size_t end, histogram_ref hist)
+{
+    const uint32_t resolution = Resolution ? Resolution : tile.pixel_resolution;
+    const std::size_t size = std::size_t(resolution) * resolution;
+
+    const __m256 min_x = _mm256_set1_ps(tile.bbox[0]);
+    const __m256 min_y = _mm256_set1_ps(tile.bbox[1]);
+    const __m256 max_x = _mm256_set1_ps(tile.bbox[2]);
+    const __m256 max_y = _mm256_set1_ps(tile.bbox[3]);
+    const __m256 inv = _mm256_set1_ps(tile.resolution_inv);
+    const __m256i stride = _mm256_set1_epi32(resolution);
+    const __m256i last = _mm256_set1_epi32(resolution - 1);
+    const __m256i offsets = _mm256_setr_epi32(0, size, 2 * size, 3 * size, 0, size, 2 * size, 3 * size);
+    static_assert(bin_lanes == 4, "offsets assume 4 sub-histograms");
+    alignas(32) uint32_t index[8];
+
+    std::size_t i = begin;
+    for (; i + 8 <= end; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(points.x + i);
+        __m256 y = _mm256_loadu_ps(points.y + i);
+        __m256 inside = _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(x, min_x, _CMP_GT_OQ), _mm256_cmp_ps(x, max_x, _CMP_LT_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(y, min_y, _CMP_GT_OQ), _mm256_cmp_ps(y, max_y, _CMP_LT_OQ)));
+        unsigned mask = _mm256_movemask_ps(inside);
+        if (!mask)
+        {
+            continue;
+        }
+        __m256i px_x = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(inv, _mm256_sub_ps(x, min_x))), last);
+        __m256i px_y = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(inv, _mm256_sub_ps(y, min_y))), last);
+        __m256i idx = _mm256_add_epi32(_mm256_mullo_epi32(px_x, stride), px_y);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(index), _mm256_add_epi32(idx, offsets));
+        for (; mask; mask &= mask - 1)
+        {
+            unsigned lane = __builtin_ctz(mask);
+            ++hist.count[index[lane]];
+            hist.sum[index[lane]] += points.amount[i + lane];
+        }
+    }
+    bin_scalar<Resolution>(tile, points, i, end, hist);
+}
+
+#endif
+
+struct kernel_info
+{
+    const char* name;
+    bin_kernel fn;
+    bool supported;
+    // whether it gives bit-identical results to bin_scalar
+    bool exact;
+    // how many histograms of the tile it writes, one after the other
+    unsigned lanes;
+};
+
+/**
+ * every kernel built into this binary for tiles of `Resolution` pixels, in
+ * order of preference for "auto", telling whether this CPU can run it
+ */
+template <uint32_t Resolution>
+inline std::vector<kernel_info> bin_kernels()
+{
+    std::vector<kernel_info> kernels;
+#ifdef CARTO_X86
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    bool avx512 = __builtin_cpu_supports("avx512f");
+    bool avx512cd = avx512 && __builtin_cpu_supports("avx512cd");
+    kernels.push_back({ "avx512", bin_avx512<Resolution>, avx512, true, 1 });
+    kernels.push_back({ "avx2", bin_avx2<Resolution>, avx2, true, 1 });
+    kernels.push_back({ "avx512cd", bin_avx512cd<Resolution>, avx512cd, true, 1 });
+    kernels.push_back({ "avx2-lanes", bin_avx2_lanes<Resolution>, avx2, false, bin_lanes });
+#endif
+    kernels.push_back({ "scalar", bin_scalar<Resolution>, true, true, 1 });
+    return kernels;
+}
+
+/**
+ * the kernels for tiles of `pixel_resolution` pixels: the specialized ones
+ * for 256, the generic ones otherwise
+ */
+inline std::vector<kernel_info> bin_kernels(uint32_t pixel_resolution)
+{
+    return pixel_resolution == 256 ? bin_kernels<256>() : bin_kernels<0>();
+}
+
+/**
+ * looks up a kernel by name, "auto" meaning the best one this CPU supports.
+ * Returns a kernel with a null fn if there is no such kernel or it is not
+ * supported.
+ */
+inline kernel_info find_bin_kernel(const std::string& name, uint32_t pixel_resolution)
+{
+    for (const auto& kernel: bin_kernels(pixel_resolution))
+    {
+        if (kernel.supported && (name == "auto" || name == kernel.name))
+        {
+            return kernel;
+        }
+    }
+    return { "", nullptr, false, false, 1 };
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Read-only memory mapping of a whole file.
+ */
+
+#ifndef CARTO_MAPPED_FILE_H
+#define CARTO_MAPPED_FILE_H
+
+#include <cerrno>
+#include <cstddef>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * maps a file in memory for reading, unmapping it on destruction.
+ * Throws std::system_error if the file cannot be opened or mapped.
+ */
+class mapped_file
+{
+public:
+    explicit mapped_file(const char* filename):
+        _data(nullptr), _size(0)
+    {
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), std::string("cannot open ") + filename);
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) < 0)
+        {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), std::string("cannot stat ") + filename);
+        }
+
+        _size = st.st_size;
+        if (_size)
+        {
+            void* addr = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED)
+            {
+                int err = errno;
+                ::close(fd);
+                throw std::system_error(err, std::generic_category(), std::string("cannot map ") + filename);
+            }
+            _data = static_cast<const char*>(addr);
+            ::madvise(addr, _size, MADV_SEQUENTIAL);
+        }
+        ::close(fd);
+    }
+
+    ~mapped_file()
+    {
+        if (_data)
+        {
+            ::munmap(const_cast<char*>(_data), _size);
+        }
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const char* data() const { return _data; }
+    const char* end() const { return _data + _size; }
+    std::size_t size() const { return _size; }
+
+private:
+    const char* _data;
+    std::size_t _size;
+};
+
+#endif
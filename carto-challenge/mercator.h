@@ -0,0 +1,53 @@
+/*
+ * Web mercator tiling: the world is a square of 2 * mercator_extent meters
+ * a side, split in 2^zoom x 2^zoom tiles at every zoom level.
+ */
+
+#ifndef CARTO_MERCATOR_H
+#define CARTO_MERCATOR_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+// half the side of the world, in meters
+const double mercator_extent = 20037508.342789244;
+
+/**
+ * side of the tiles of zoom level `zoom`, in meters
+ */
+inline double mercator_tile_size(int zoom)
+{
+    return std::ldexp(2 * mercator_extent, -zoom);
+}
+
+/**
+ * bounds (min x, min y, max x, max y) of tile `x`, `y` of zoom level `zoom`,
+ * tile rows going down from the north like in XYZ tile servers
+ */
+inline void mercator_tile_bbox(int zoom, uint32_t x, uint32_t y, double bbox[4])
+{
+    double size = mercator_tile_size(zoom);
+    bbox[0] = -mercator_extent + x * size;
+    bbox[1] = mercator_extent - (y + 1.0) * size;
+    bbox[2] = bbox[0] + size;
+    bbox[3] = mercator_extent - y * size;
+}
+
+/**
+ * parses tile coordinates like "10/301/384" into `zoom`, `x` and `y`.
+ * Throws std::invalid_argument if they are malformed or out of range.
+ */
+inline void parse_tile(const std::string& tile, int& zoom, uint32_t& x, uint32_t& y)
+{
+    char end;
+    if (std::sscanf(tile.c_str(), "%d/%u/%u%c", &zoom, &x, &y, &end) != 3 ||
+        zoom < 0 || zoom > 30 || x >> zoom || y >> zoom)
+    {
+        throw std::invalid_argument("bad tile: " + tile + ", expected zoom/x/y");
+    }
+}
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ * Morton (Z-order) codes and the parallel sorts used to reorder points.
+ *
+ * Interleaving the bits of the pixel coordinates keeps pixels that are close
+ * in both directions close in the code, so points sorted by it hit the
+ * histogram in small neighbourhoods instead of all over it.
+ */
+
+#ifndef CARTO_MORTON_H
+#define CARTO_MORTON_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "thread_pool.h"
+
+/**
+ * spreads the low 16 bits of `v` to the even bits of the result
+ */
+inline uint32_t morton_spread(uint32_t v)
+{
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+/**
+ * Morton code of pixel (x, y), x taking the odd bits
+ */
+inline uint32_t morton_code(uint32_t x, uint32_t y)
+{
+    return (morton_spread(x) << 1) | morton_spread(y);
+}
+
+// bits sorted per radix_sort() pass
+const unsigned radix_bits = 9;
+
+/**
+ * sorts `keys`, all below 2^bits, carrying `values` along. The sort is
+ * stable. Each pass splits the keys in one block per pool worker, counts
+ * the digits of every block, and scatters every block to its own offsets.
+ */
+inline void radix_sort(std::vector<uint32_t>& keys, std::vector<uint32_t>& values, unsigned bits,
+                       thread_pool& pool)
+{
+    const std::size_t buckets = std::size_t(1) << radix_bits;
+    const std::size_t n = keys.size();
+    const std::size_t blocks = pool.size();
+    std::vector<uint32_t> sorted_keys(n);
+    std::vector<uint32_t> sorted_values(n);
+    // offsets[block * buckets + digit]
+    std::vector<std::size_t> offsets(blocks * buckets);
+
+    for (unsigned shift = 0; shift < bits; shift += radix_bits)
+    {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        pool.for_each(blocks, [&] (std::size_t block, unsigned) {
+            std::size_t* counts = &offsets[block * buckets];
+            for (std::size_t i = n * block / blocks; i < n * (block + 1) / blocks; ++i)
+            {
+                ++counts[(keys[i] >> shift) & (buckets - 1)];
+            }
+        });
+
+        std::size_t total = 0;
+        for (std::size_t digit = 0; digit < buckets; ++digit)
+        {
+            for (std::size_t block = 0; block < blocks; ++block)
+            {
+                std::size_t count = offsets[block * buckets + digit];
+                offsets[block * buckets + digit] = total;
+                total += count;
+            }
+        }
+
+        pool.for_each(blocks, [&] (std::size_t block, unsigned) {
+            std::size_t* next = &offsets[block * buckets];
+            for (std::size_t i = n * block / blocks; i < n * (block + 1) / blocks; ++i)
+            {
+                std::size_t to = next[(keys[i] >> shift) & (buckets - 1)]++;
+                sorted_keys[to] = keys[i];
+                sorted_values[to] = values[i];
+            }
+        });
+        keys.swap(sorted_keys);
+        values.swap(sorted_values);
+    }
+}
+
+/**
+ * stable counting sort of `n` items into `buckets` buckets, `key(i)` being
+ * the bucket of item i and `move(i, to)` moving it to position `to`. Every
+ * pool worker counts the keys of a block of items, and a scan over (bucket,
+ * block) gives each block where to move its items. Returns where every
+ * bucket starts, followed by n.
+ */
+template <typename Key, typename Move>
+std::vector<std::size_t> counting_sort(std::size_t n, std::size_t buckets, const Key& key, const Move& move,
+                                       thread_pool& pool)
+{
+    const std::size_t blocks = pool.size();
+    // next[block * buckets + bucket]
+    std::vector<std::size_t> next(blocks * buckets);
+    pool.for_each(blocks, [&] (std::size_t block, unsigned) {
+        std::size_t* counts = &next[block * buckets];
+        for (std::size_t i = n * block / blocks; i < n * (block + 1) / blocks; ++i)
+        {
+            ++counts[key(i)];
+        }
+    });
+
+    std::vector<std::size_t> offsets(buckets + 1);
+    std::size_t total = 0;
+    for (std::size_t bucket = 0; bucket < buckets; ++bucket)
+    {
+        offsets[bucket] = total;
+        for (std::size_t block = 0; block < blocks; ++block)
+        {
+            std::size_t count = next[block * buckets + bucket];
+            next[block * buckets + bucket] = total;
+            total += count;
+        }
+    }
+    offsets[buckets] = total;
+
+    pool.for_each(blocks, [&] (std::size_t block, unsigned) {
+        std::size_t* to = &next[block * buckets];
+        for (std::size_t i = n * block / blocks; i < n * (block + 1) / blocks; ++i)
+        {
+            move(i, to[key(i)]++);
+        }
+    });
+    return offsets;
+}
+
+#endif
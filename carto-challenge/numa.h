@@ -0,0 +1,217 @@
+/*
+ * NUMA topology and thread pinning, read from sysfs so that no libnuma is
+ * needed. On systems without that information everything is one node.
+ */
+
+#ifndef CARTO_NUMA_H
+#define CARTO_NUMA_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct numa_node
+{
+    int id;
+    std::vector<int> cpus;
+};
+
+/**
+ * parses a kernel cpu list like "0-3,8,10-11"
+ */
+inline std::vector<int> parse_cpu_list(const std::string& list)
+{
+    std::vector<int> cpus;
+    std::istringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ','))
+    {
+        if (range.empty() || range.find_first_not_of(" \n") == std::string::npos)
+        {
+            continue;
+        }
+        std::size_t dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * the NUMA nodes with CPUs, or a single node with every CPU if the topology
+ * is not available
+ */
+inline std::vector<numa_node> numa_nodes()
+{
+    std::vector<numa_node> nodes;
+    std::ifstream online("/sys/devices/system/node/has_cpu");
+    std::string list;
+    if (std::getline(online, list))
+    {
+        for (int id: parse_cpu_list(list))
+        {
+            std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+            std::string cpus;
+            if (std::getline(cpulist, cpus) && !parse_cpu_list(cpus).empty())
+            {
+                nodes.push_back({ id, parse_cpu_list(cpus) });
+            }
+        }
+    }
+    if (nodes.empty())
+    {
+        numa_node all = { 0, {} };
+        unsigned count = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned cpu = 0; cpu < count; ++cpu)
+        {
+            all.cpus.push_back(cpu);
+        }
+        nodes.push_back(all);
+    }
+    return nodes;
+}
+
+/**
+ * restricts `thread` to `cpus`. Returns false if that is not possible, such
+ * as when none of them is online or allowed to this process.
+ */
+inline bool pin_thread(std::thread& thread, const std::vector<int>& cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: cpus)
+    {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+        {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void) thread;
+    (void) cpus;
+    return false;
+#endif
+}
+
+/**
+ * the CPUs this process may run on, or an empty list if unknown
+ */
+inline std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    return cpus;
+}
+
+/**
+ * the CPU the calling thread is running on, or -1 if unknown
+ */
+inline int current_cpu()
+{
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+/**
+ * picks one CPU for each of `threads` workers following `policy`:
+ *
+ *   compact    fill the CPUs of a node before moving to the next one
+ *   scatter    round robin over the nodes
+ *   LIST       the CPUs in a list like "0-3,8", in order, wrapping around
+ *
+ * compact and scatter skip the CPUs this process may not run on. Throws
+ * std::invalid_argument for an empty or malformed policy, or a list with
+ * such CPUs.
+ */
+inline std::vector<int> pin_cpus(const std::string& policy, const std::vector<numa_node>& nodes, unsigned threads)
+{
+    const std::vector<int> allowed = allowed_cpus();
+    auto is_allowed = [&] (int cpu) {
+        return allowed.empty() || std::find(allowed.begin(), allowed.end(), cpu) != allowed.end();
+    };
+    std::vector<int> order;
+    if (policy == "compact")
+    {
+        for (const auto& node: nodes)
+        {
+            order.insert(order.end(), node.cpus.begin(), node.cpus.end());
+        }
+    }
+    else if (policy == "scatter")
+    {
+        for (std::size_t i = 0; ; ++i)
+        {
+            bool any = false;
+            for (const auto& node: nodes)
+            {
+                if (i < node.cpus.size())
+                {
+                    order.push_back(node.cpus[i]);
+                    any = true;
+                }
+            }
+            if (!any)
+            {
+                break;
+            }
+        }
+    }
+    else if (policy.find_first_not_of("0123456789,-") == std::string::npos)
+    {
+        order = parse_cpu_list(policy);
+        for (int cpu: order)
+        {
+            if (!is_allowed(cpu))
+            {
+                throw std::invalid_argument("CPU " + std::to_string(cpu) + " is not available to this process");
+            }
+        }
+    }
+    order.erase(std::remove_if(order.begin(), order.end(), [&] (int cpu) { return !is_allowed(cpu); }),
+                order.end());
+    if (order.empty())
+    {
+        throw std::invalid_argument("bad pinning policy: " + policy);
+    }
+
+    std::vector<int> cpus;
+    for (unsigned worker = 0; worker < threads; ++worker)
+    {
+        cpus.push_back(order[worker % order.size()]);
+    }
+    return cpus;
+}
+
+#endif
@@ -0,0 +1,555 @@
+/*
+ * Minimal PNG encoder for 8 bit grayscale and RGBA images, with its own
+ * deflate so that no zlib is needed.
+ *
+ * Two compressions are supported:
+ *
+ *   stored     no compression at all, rows unfiltered: the fastest to write
+ *   rle        rows go through the Sub filter, which turns smooth gradients
+ *              into small values and runs of equal pixels into zeros, runs
+ *              of equal bytes become deflate matches at distance 1, and all
+ *              of it goes in one block of Huffman codes made for the image
+ *
+ * Searching only for runs instead of matches anywhere back, like zlib's
+ * Z_RLE strategy, rle gets close to what a full deflate would on tiles for
+ * a fraction of the work.
+ */
+
+#ifndef CARTO_PNG_H
+#define CARTO_PNG_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+enum class png_compression
+{
+    stored,
+    rle
+};
+
+/**
+ * parses "stored" or "rle". Throws std::invalid_argument for anything else.
+ */
+inline png_compression parse_png_compression(const std::string& name)
+{
+    if (name == "stored")
+    {
+        return png_compression::stored;
+    }
+    if (name == "rle")
+    {
+        return png_compression::rle;
+    }
+    throw std::invalid_argument("bad png compression: " + name);
+}
+
+namespace png_detail
+{
+
+struct crc_table
+{
+    uint32_t entries[256];
+
+    crc_table()
+    {
+        for (uint32_t n = 0; n < 256; ++n)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+            {
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            entries[n] = c;
+        }
+    }
+};
+
+inline uint32_t crc32(const uint8_t* data, std::size_t size, uint32_t crc = 0)
+{
+    static const crc_table table;
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+inline uint32_t adler32(const uint8_t* data, std::size_t size)
+{
+    // the sums cannot overflow 32 bits within 5552 bytes
+    const std::size_t block = 5552;
+    uint32_t a = 1, b = 0;
+    while (size)
+    {
+        std::size_t n = std::min(size, block);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += n;
+        size -= n;
+    }
+    return (b << 16) | a;
+}
+
+inline void put_u32(std::vector<uint8_t>& out, uint32_t value)
+{
+    uint8_t bytes[] = { uint8_t(value >> 24), uint8_t(value >> 16), uint8_t(value >> 8), uint8_t(value) };
+    out.insert(out.end(), bytes, bytes + 4);
+}
+
+/**
+ * deflate bits, least significant first
+ */
+class bit_writer
+{
+public:
+    explicit bit_writer(std::vector<uint8_t>& out):
+        _out(out), _bits(0), _count(0)
+    {}
+
+    void put(uint32_t bits, unsigned count)
+    {
+        _bits |= uint64_t(bits) << _count;
+        _count += count;
+        while (_count >= 8)
+        {
+            _out.push_back(uint8_t(_bits));
+            _bits >>= 8;
+            _count -= 8;
+        }
+    }
+
+    /**
+     * pads to the next byte
+     */
+    void flush()
+    {
+        if (_count)
+        {
+            put(0, 8 - _count);
+        }
+    }
+
+private:
+    std::vector<uint8_t>& _out;
+    uint64_t _bits;
+    unsigned _count;
+};
+
+/**
+ * symbol and extra bits of every match length 3..258
+ */
+struct length_codes
+{
+    uint16_t symbol[259];
+    uint8_t extra_bits[259];
+    uint16_t extra[259];
+
+    length_codes()
+    {
+        static const uint16_t base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                         35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static const uint8_t bits[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        for (uint32_t i = 0; i < 29; ++i)
+        {
+            uint32_t end = i < 28 ? base[i + 1] : 259;
+            for (uint32_t n = base[i]; n < end; ++n)
+            {
+                symbol[n] = 257 + i;
+                extra_bits[n] = bits[i];
+                extra[n] = n - base[i];
+            }
+        }
+    }
+};
+
+/**
+ * Huffman code lengths of `n` symbols with frequencies `freqs`, none longer
+ * than `max_bits`, into `lengths`. Unused symbols get 0, and a lone used
+ * symbol 1. Codes too long are fixed by halving the frequencies and trying
+ * again, which is rare and costs little.
+ */
+inline void huffman_lengths(const uint32_t* freqs, std::size_t n, unsigned max_bits, uint8_t* lengths)
+{
+    std::vector<uint32_t> weights(freqs, freqs + n);
+    for (;;)
+    {
+        // leaves sorted by weight, then the internal nodes, which come in
+        // order of weight too, so merging the two queues builds the tree
+        std::vector<uint32_t> leaves;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            lengths[i] = 0;
+            if (weights[i])
+            {
+                leaves.push_back(uint32_t(i));
+            }
+        }
+        if (leaves.size() <= 1)
+        {
+            for (uint32_t leaf: leaves)
+            {
+                lengths[leaf] = 1;
+            }
+            return;
+        }
+        std::stable_sort(leaves.begin(), leaves.end(), [&] (uint32_t a, uint32_t b) {
+            return weights[a] < weights[b];
+        });
+
+        // nodes [0, leaves) are the leaves, the rest internal ones
+        std::size_t count = leaves.size();
+        std::vector<uint64_t> weight(2 * count - 1);
+        std::vector<uint32_t> parent(2 * count - 1);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            weight[i] = weights[leaves[i]];
+        }
+        std::size_t leaf = 0, node = count;
+        for (std::size_t next = count; next < 2 * count - 1; ++next)
+        {
+            uint32_t pair[2];
+            for (uint32_t& child: pair)
+            {
+                bool take_leaf = leaf < count && (node >= next || weight[leaf] <= weight[node]);
+                child = uint32_t(take_leaf ? leaf++ : node++);
+            }
+            weight[next] = weight[pair[0]] + weight[pair[1]];
+            parent[pair[0]] = parent[pair[1]] = uint32_t(next);
+        }
+
+        // depths from the root down, parents coming after their children
+        std::vector<uint8_t> depth(2 * count - 1);
+        unsigned deepest = 0;
+        for (std::size_t i = 2 * count - 1; i-- > 0; )
+        {
+            depth[i] = i == 2 * count - 2 ? 0 : depth[parent[i]] + 1;
+            deepest = std::max<unsigned>(deepest, depth[i]);
+        }
+        if (deepest <= max_bits)
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                lengths[leaves[i]] = depth[i];
+            }
+            return;
+        }
+        for (uint32_t& w: weights)
+        {
+            w = w ? (w >> 1) | 1 : 0;
+        }
+    }
+}
+
+/**
+ * canonical Huffman codes of `lengths`, bit reversed so that bit_writer
+ * can put them as they are
+ */
+inline void huffman_codes(const uint8_t* lengths, std::size_t n, uint16_t* codes)
+{
+    uint32_t count[16] = { 0 };
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        ++count[lengths[i]];
+    }
+    count[0] = 0;
+    uint32_t next[16] = { 0 };
+    for (unsigned bits = 1; bits < 16; ++bits)
+    {
+        next[bits] = (next[bits - 1] + count[bits - 1]) << 1;
+    }
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        uint32_t code = next[lengths[i]]++, reversed = 0;
+        for (unsigned bit = 0; bit < lengths[i]; ++bit)
+        {
+            reversed |= ((code >> bit) & 1) << (lengths[i] - 1 - bit);
+        }
+        codes[i] = uint16_t(reversed);
+    }
+}
+
+/**
+ * calls `fn(value, run)` for every byte of `data` that is not repeating the
+ * previous one, with the number of bytes repeating it right after, up to
+ * the longest deflate match. Runs shorter than a match come as single
+ * bytes.
+ */
+template <typename Fn>
+void byte_runs(const uint8_t* data, std::size_t size, const Fn& fn)
+{
+    std::size_t i = 0;
+    while (i < size)
+    {
+        uint8_t value = data[i];
+        std::size_t run = 0;
+        while (i + 1 + run < size && run < 258 && data[i + 1 + run] == value)
+        {
+            ++run;
+        }
+        run = run >= 3 ? run : 0;
+        fn(value, uint32_t(run));
+        i += 1 + run;
+    }
+}
+
+/**
+ * calls `fn(symbol, extra)` for the code length alphabet symbols encoding
+ * `lengths`: 16 repeats the previous length 3..6 times, 17 and 18 give
+ * runs of 3..10 and 11..138 zeros
+ */
+template <typename Fn>
+void length_runs(const uint8_t* lengths, std::size_t n, const Fn& fn)
+{
+    std::size_t i = 0;
+    while (i < n)
+    {
+        uint8_t length = lengths[i];
+        std::size_t run = 1;
+        while (i + run < n && lengths[i + run] == length)
+        {
+            ++run;
+        }
+        if (length == 0 && run >= 3)
+        {
+            run = std::min<std::size_t>(run, 138);
+            fn(run <= 10 ? 17 : 18, uint32_t(run - (run <= 10 ? 3 : 11)));
+        }
+        else
+        {
+            fn(length, 0);
+            run = 1;
+            std::size_t repeats = 0;
+            while (i + run + repeats < n && repeats < 6 && lengths[i + run + repeats] == length)
+            {
+                ++repeats;
+            }
+            if (repeats >= 3)
+            {
+                fn(16, uint32_t(repeats - 3));
+                run += repeats;
+            }
+        }
+        i += run;
+    }
+}
+
+/**
+ * deflates `data` in stored blocks
+ */
+inline void deflate_stored(const uint8_t* data, std::size_t size, std::vector<uint8_t>& out)
+{
+    std::size_t offset = 0;
+    do
+    {
+        std::size_t n = std::min<std::size_t>(size - offset, 65535);
+        bool last = offset + n == size;
+        uint8_t header[] = { uint8_t(last), uint8_t(n), uint8_t(n >> 8), uint8_t(~n), uint8_t(~n >> 8) };
+        out.insert(out.end(), header, header + 5);
+        out.insert(out.end(), data + offset, data + offset + n);
+        offset += n;
+    }
+    while (offset < size);
+}
+
+/**
+ * deflates `data` in one block of dynamic Huffman codes, runs of a byte
+ * going as the byte and a match at distance 1. Falls back to stored blocks
+ * if those are smaller.
+ */
+inline void deflate_rle(const uint8_t* data, std::size_t size, std::vector<uint8_t>& out)
+{
+    static const length_codes lengths;
+    static const uint8_t length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    static const uint8_t length_run_bits[19] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+
+    // literal and length codes, the only distance being 1. Bits counts the
+    // block size, starting with its header and the extra bits of matches.
+    uint32_t freqs[286] = { 0 };
+    uint64_t bits = 3 + 5 + 5 + 4;
+    byte_runs(data, size, [&] (uint8_t value, uint32_t run) {
+        ++freqs[value];
+        if (run)
+        {
+            ++freqs[lengths.symbol[run]];
+            // and the 1 bit distance code
+            bits += lengths.extra_bits[run] + 1;
+        }
+    });
+    freqs[256] = 1;
+    uint8_t code_lengths[287];
+    uint16_t codes[286];
+    huffman_lengths(freqs, 286, 15, code_lengths);
+    huffman_codes(code_lengths, 286, codes);
+    std::size_t literals = 286;
+    while (code_lengths[literals - 1] == 0)
+    {
+        --literals;
+    }
+    // the distance code lengths follow the literal ones: 1 bit for code 0
+    code_lengths[literals] = 1;
+
+    // the code lengths go with their own code
+    uint32_t length_freqs[19] = { 0 };
+    length_runs(code_lengths, literals + 1, [&] (uint32_t symbol, uint32_t) {
+        ++length_freqs[symbol];
+    });
+    // unlike the others, this code must be complete, so it needs two symbols
+    if (std::count_if(length_freqs, length_freqs + 19, [] (uint32_t freq) { return freq != 0; }) < 2)
+    {
+        ++length_freqs[length_freqs[0] ? 1 : 0];
+    }
+    uint8_t length_lengths[19];
+    uint16_t length_codes[19];
+    huffman_lengths(length_freqs, 19, 7, length_lengths);
+    huffman_codes(length_lengths, 19, length_codes);
+    std::size_t length_count = 19;
+    while (length_count > 4 && length_lengths[length_order[length_count - 1]] == 0)
+    {
+        --length_count;
+    }
+
+    bits += 3 * length_count;
+    for (uint32_t symbol = 0; symbol < 19; ++symbol)
+    {
+        bits += uint64_t(length_freqs[symbol]) * (length_lengths[symbol] + length_run_bits[symbol]);
+    }
+    for (uint32_t symbol = 0; symbol < 286; ++symbol)
+    {
+        bits += uint64_t(freqs[symbol]) * code_lengths[symbol];
+    }
+    if ((bits + 7) / 8 >= size + 5 * (size / 65535 + 1))
+    {
+        deflate_stored(data, size, out);
+        return;
+    }
+
+    bit_writer writer(out);
+    // last block, dynamic Huffman codes
+    writer.put(5, 3);
+    writer.put(uint32_t(literals - 257), 5);
+    writer.put(0, 5);
+    writer.put(uint32_t(length_count - 4), 4);
+    for (std::size_t i = 0; i < length_count; ++i)
+    {
+        writer.put(length_lengths[length_order[i]], 3);
+    }
+    length_runs(code_lengths, literals + 1, [&] (uint32_t symbol, uint32_t extra) {
+        writer.put(length_codes[symbol], length_lengths[symbol]);
+        writer.put(extra, length_run_bits[symbol]);
+    });
+    byte_runs(data, size, [&] (uint8_t value, uint32_t run) {
+        writer.put(codes[value], code_lengths[value]);
+        if (run)
+        {
+            uint32_t symbol = lengths.symbol[run];
+            writer.put(codes[symbol], code_lengths[symbol]);
+            writer.put(lengths.extra[run], lengths.extra_bits[run]);
+            writer.put(0, 1);
+        }
+    });
+    writer.put(codes[256], code_lengths[256]);
+    writer.flush();
+}
+
+inline void put_chunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, std::size_t size)
+{
+    put_u32(out, uint32_t(size));
+    std::size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    put_u32(out, crc32(&out[start], out.size() - start));
+}
+
+}
+
+/**
+ * encodes a `width` x `height` image of `channels` bytes per pixel, 1 for
+ * grayscale or 4 for RGBA, rows going top down, and appends the PNG file to
+ * `out`. `scratch` holds the filtered rows, so that reusing it does not
+ * allocate.
+ */
+inline void encode_png(const uint8_t* pixels, uint32_t width, uint32_t height, unsigned channels,
+                       png_compression compression, std::vector<uint8_t>& out, std::vector<uint8_t>& scratch)
+{
+    using namespace png_detail;
+    if (channels != 1 && channels != 4)
+    {
+        throw std::invalid_argument("png images are grayscale or RGBA");
+    }
+    const std::size_t stride = std::size_t(width) * channels;
+    const std::size_t raw_size = (stride + 1) * height;
+
+    // filter type byte and filtered bytes of every row
+    scratch.resize(raw_size);
+    uint8_t* raw = scratch.data();
+    for (uint32_t row = 0; row < height; ++row)
+    {
+        const uint8_t* in = pixels + row * stride;
+        uint8_t* filtered = raw + row * (stride + 1);
+        if (compression == png_compression::stored)
+        {
+            filtered[0] = 0;
+            std::memcpy(filtered + 1, in, stride);
+        }
+        else
+        {
+            // Sub: every byte minus the same byte of the pixel to its left
+            filtered[0] = 1;
+            std::memcpy(filtered + 1, in, std::min<std::size_t>(channels, stride));
+            for (std::size_t i = channels; i < stride; ++i)
+            {
+                filtered[1 + i] = uint8_t(in[i] - in[i - channels]);
+            }
+        }
+    }
+
+    static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    out.insert(out.end(), signature, signature + 8);
+
+    uint8_t header[13] = {
+        uint8_t(width >> 24), uint8_t(width >> 16), uint8_t(width >> 8), uint8_t(width),
+        uint8_t(height >> 24), uint8_t(height >> 16), uint8_t(height >> 8), uint8_t(height),
+        // 8 bits, grayscale or RGBA, deflate, adaptive filters, no interlace
+        8, uint8_t(channels == 1 ? 0 : 6), 0, 0, 0
+    };
+    put_chunk(out, "IHDR", header, sizeof(header));
+
+    // the zlib stream goes straight into the IDAT chunk, whose length is
+    // known once it is done
+    std::size_t length_at = out.size();
+    put_u32(out, 0);
+    std::size_t type_at = out.size();
+    static const char idat[] = "IDAT";
+    out.insert(out.end(), idat, idat + 4);
+    out.push_back(0x78);
+    out.push_back(0x01);
+    if (compression == png_compression::stored)
+    {
+        deflate_stored(raw, raw_size, out);
+    }
+    else
+    {
+        deflate_rle(raw, raw_size, out);
+    }
+    put_u32(out, adler32(raw, raw_size));
+    uint32_t length = uint32_t(out.size() - type_at - 4);
+    for (int i = 0; i < 4; ++i)
+    {
+        out[length_at + i] = uint8_t(length >> (24 - 8 * i));
+    }
+    put_u32(out, crc32(&out[type_at], out.size() - type_at));
+    put_chunk(out, "IEND", nullptr, 0);
+}
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * Point containers shared by torque and torque-mod.
+ */
+
+#ifndef CARTO_POINTS_H
+#define CARTO_POINTS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include <vector>
+
+struct row
+{
+    float x, y, amount;
+};
+
+// columns are padded to a multiple of this many values (one AVX-512 register)
+const std::size_t simd_width = 16;
+
+inline std::size_t padded_count(std::size_t count)
+{
+    return (count + simd_width - 1) / simd_width * simd_width;
+}
+
+/**
+ * allocator returning memory aligned to `Align` bytes
+ */
+template <typename T, std::size_t Align = 64>
+struct aligned_allocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef aligned_allocator<U, Align> other;
+    };
+
+    aligned_allocator() {}
+
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U, Align>&) {}
+
+    T* allocate(std::size_t n)
+    {
+        void* p = nullptr;
+        if (posix_memalign(&p, Align, n * sizeof(T)))
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t)
+    {
+        std::free(p);
+    }
+
+    template <typename U>
+    bool operator==(const aligned_allocator<U, Align>&) const { return true; }
+
+    template <typename U>
+    bool operator!=(const aligned_allocator<U, Align>&) const { return false; }
+};
+
+/**
+ * read-only view of point columns. Each column holds `size` values and is
+ * readable up to `padded_size()`, the padding being NaN so that it never
+ * passes a bbox test.
+ */
+struct column_view
+{
+    const float* x;
+    const float* y;
+    const float* amount;
+    std::size_t size;
+
+    std::size_t padded_size() const { return padded_count(size); }
+};
+
+/**
+ * structure-of-arrays point storage: separate x, y and amount columns,
+ * 64-byte aligned and NaN padded to a multiple of simd_width values.
+ *
+ * The columns are either owned or borrowed from some other storage (like a
+ * mapped points file) that is kept alive by `owner`.
+ */
+class point_columns
+{
+public:
+    point_columns()
+    {
+        _view.x = _view.y = _view.amount = nullptr;
+        _view.size = 0;
+    }
+
+    point_columns(const point_columns&) = delete;
+    point_columns& operator=(const point_columns&) = delete;
+
+    std::size_t size() const { return _view.size; }
+    const column_view& view() const { return _view; }
+
+    /**
+     * uses the columns of `view` in place, keeping `owner` alive meanwhile
+     */
+    void borrow(const column_view& view, std::shared_ptr<const void> owner)
+    {
+        _x.clear();
+        _y.clear();
+        _amount.clear();
+        _owner = std::move(owner);
+        _view = view;
+    }
+
+    /**
+     * resizes the columns, preserving the first min(size(), n) points
+     */
+    void resize(std::size_t n)
+    {
+        if (_owner)
+        {
+            // copy borrowed columns before changing them
+            _x.assign(_view.x, _view.x + _view.size);
+            _y.assign(_view.y, _view.y + _view.size);
+            _amount.assign(_view.amount, _view.amount + _view.size);
+            _owner.reset();
+        }
+        column* columns[] = { &_x, &_y, &_amount };
+        for (column* c: columns)
+        {
+            c->resize(padded_count(n));
+            std::fill(c->begin() + n, c->end(), std::numeric_limits<float>::quiet_NaN());
+        }
+        _view.x = _x.data();
+        _view.y = _y.data();
+        _view.amount = _amount.data();
+        _view.size = n;
+    }
+
+    void set(std::size_t i, const row& r)
+    {
+        _x[i] = r.x;
+        _y[i] = r.y;
+        _amount[i] = r.amount;
+    }
+
+    void assign(const std::vector<row>& rows)
+    {
+        resize(0);
+        resize(rows.size());
+        for (std::size_t i = 0; i < rows.size(); ++i)
+        {
+            set(i, rows[i]);
+        }
+    }
+
+private:
+    typedef std::vector<float, aligned_allocator<float>> column;
+
+    column _x, _y, _amount;
+    std::shared_ptr<const void> _owner;
+    column_view _view;
+};
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * Binary columnar point files, as written by torque-convert.
+ *
+ * Layout (native byte order, every section 64-byte aligned):
+ *
+ *   header                             64 bytes
+ *   x[count]       float32, padded with NaN to a multiple of simd_width
+ *   y[count]       idem
+ *   amount[count]  idem
+ *
+ * NaN padding fails every bbox test, so kernels may safely run over the
+ * padded length of the columns.
+ */
+
+#ifndef CARTO_POINTS_FILE_H
+#define CARTO_POINTS_FILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "points.h"
+
+namespace points_file
+{
+    const char magic[8] = { 'T', 'O', 'R', 'Q', 'P', 'T', 'S', '\0' };
+    const uint32_t version = 1;
+
+    struct header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        uint64_t count;
+        // bounds of the points: min x, min y, max x, max y
+        float bbox[4];
+        char reserved[24];
+    };
+    static_assert(sizeof(header) == 64, "points file header must be 64 bytes");
+
+    inline bool is_points_file(const mapped_file& file)
+    {
+        return file.size() >= sizeof(header) && std::memcmp(file.data(), magic, sizeof(magic)) == 0;
+    }
+
+    /**
+     * read-only view of a mapped points file
+     */
+    struct view
+    {
+        const header* head;
+        column_view columns;
+    };
+
+    /**
+     * validates the header of a mapped points file and locates its columns.
+     * Throws std::runtime_error if the file is not a valid points file.
+     */
+    inline view open(const mapped_file& file)
+    {
+        if (!is_points_file(file))
+        {
+            throw std::runtime_error("not a points file");
+        }
+        view v;
+        v.head = reinterpret_cast<const header*>(file.data());
+        if (v.head->version != version || v.head->header_size != sizeof(header))
+        {
+            throw std::runtime_error("unsupported points file version");
+        }
+        // the count is checked before padding it, which would wrap for
+        // counts near 2^64
+        std::size_t capacity = (file.size() - sizeof(header)) / sizeof(float) / 3;
+        if (v.head->count > capacity || padded_count(v.head->count) > capacity)
+        {
+            throw std::runtime_error("truncated points file");
+        }
+        std::size_t column = padded_count(v.head->count);
+        v.columns.x = reinterpret_cast<const float*>(file.data() + sizeof(header));
+        v.columns.y = v.columns.x + column;
+        v.columns.amount = v.columns.y + column;
+        v.columns.size = v.head->count;
+        return v;
+    }
+
+    /**
+     * writes `rows` as a points file. Throws std::runtime_error on failure.
+     */
+    inline void write(const std::vector<row>& rows, const char* filename)
+    {
+        header head;
+        std::memset(&head, 0, sizeof(head));
+        std::memcpy(head.magic, magic, sizeof(magic));
+        head.version = version;
+        head.header_size = sizeof(header);
+        head.count = rows.size();
+        head.bbox[0] = head.bbox[1] = std::numeric_limits<float>::infinity();
+        head.bbox[2] = head.bbox[3] = -std::numeric_limits<float>::infinity();
+        for (const auto& r: rows)
+        {
+            head.bbox[0] = std::min(head.bbox[0], r.x);
+            head.bbox[1] = std::min(head.bbox[1], r.y);
+            head.bbox[2] = std::max(head.bbox[2], r.x);
+            head.bbox[3] = std::max(head.bbox[3], r.y);
+        }
+
+        std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&head), sizeof(head));
+
+        std::vector<float> column(padded_count(rows.size()), std::numeric_limits<float>::quiet_NaN());
+        float row::* fields[] = { &row::x, &row::y, &row::amount };
+        for (auto field: fields)
+        {
+            for (std::size_t i = 0; i < rows.size(); ++i)
+            {
+                column[i] = rows[i].*field;
+            }
+            file.write(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(float));
+        }
+
+        if (!file.flush())
+        {
+            throw std::runtime_error(std::string("cannot write ") + filename);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,1387 @@
+/*
+ * The rendering engine of torque-mod: the tile being rendered, binning the
+ * points into grids in parallel, pyramids and tile batches, and encoding the
+ * grids as images. Its globals live in an anonymous namespace, so every
+ * program includes it from a single translation unit.
+ */
+
+#ifndef CARTO_RENDER_H
+#define CARTO_RENDER_H
+
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <functional>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "csv.h"
+#include "color_ramp.h"
+#include "kernels.h"
+#include "mercator.h"
+#include "morton.h"
+#include "numa.h"
+#include "png.h"
+#include "spatial_index.h"
+#include "thread_pool.h"
+
+namespace
+{
+    // default tile bbox, which is tile 10/301/384. Points carry their
+    // northing in x and their easting in y, so this is (min northing, min
+    // easting, max northing, max easting)
+    const float BBOX[] = { 4970241.3272153, -8257645.03970416,  5009377.08569731, -8218509.28122215 };
+    const int BBOX_ZOOM = 10;
+    const uint32_t BBOX_X = 301;
+    const uint32_t BBOX_Y = 384;
+    // default tile size in pixels, with kernels specialized for it
+    const uint32_t pixel_resolution = 256;
+    // resolution per in meters per pixel
+    const float resolution = 152.874056570353;
+    // helper
+    const float resolution_inv = 1.0/resolution;
+
+    // the tile being rendered, see set_tile()
+    tile_geometry TILE = { { BBOX[0], BBOX[1], BBOX[2], BBOX[3] }, resolution_inv, pixel_resolution };
+    int tile_zoom = BBOX_ZOOM;
+    // pixels in TILE
+    int grid_size = pixel_resolution * pixel_resolution;
+
+    // points claimed at a time by grid() workers, a multiple of simd_width
+    const std::size_t grid_chunk_size = 1 << 14;
+    // pixels reduced at a time when merging partial histograms
+    const std::size_t merge_slice_size = 1 << 12;
+    // pixel rows binned at a time by band_grid() workers
+    const uint32_t band_rows = 16;
+    // rows per batch in streaming mode
+    const std::size_t stream_batch_size = 1 << 16;
+    // zoom levels between the tile and the cells of --index
+    const int index_zoom_levels = 2;
+    // most cells --index keeps, going to coarser zoom levels if needed
+    const std::size_t index_max_cells = 1 << 16;
+    // fixed point units per amount unit in --deterministic mode: amounts are
+    // rounded to 1/65536, and pixel sums must stay below 2^47, else grid()
+    // throws std::overflow_error
+    const double fixed_scale = 65536.0;
+    // 2^63, past the fixed point sums
+    const double fixed_limit = 9223372036854775808.0;
+
+    // kernel used to bin point columns, see --kernel
+    bin_kernel column_kernel = bin_scalar<pixel_resolution>;
+    // histograms of the tile column_kernel writes, which every partial holds
+    unsigned column_lanes = 1;
+};
+
+/**
+ * adds the rows in [begin, end) to the (not yet normalized) histogram
+ */
+template <typename It>
+void accumulate(It begin, It end, histogram& hist)
+{
+    // a copy, which the compiler knows the histogram does not overlap
+    const tile_geometry tile = TILE;
+    for(auto it = begin; it != end; ++it)
+    {
+        const auto& r = *it;
+        uint32_t x, y;
+        if (tile_pixel(tile, r.x, r.y, x, y))
+        {
+            uint32_t p = x * tile.pixel_resolution + y;
+            ++hist.count[p];
+            hist.sum[p] += r.amount;
+        }
+    }
+}
+
+/**
+ * adds the points in [begin, end) to the (not yet normalized) histogram,
+ * reading the x, y and amount columns separately
+ */
+inline void accumulate(const column_view& points, std::size_t begin, std::size_t end, histogram& hist)
+{
+    column_kernel(TILE, points, begin, end, hist.ref());
+}
+
+inline void accumulate(const std::vector<row>& rows, std::size_t begin, std::size_t end, histogram& hist)
+{
+    accumulate(rows.begin() + begin, rows.begin() + end, hist);
+}
+
+inline std::size_t point_count(const std::vector<row>& rows)
+{
+    return rows.size();
+}
+
+inline std::size_t point_count(const column_view& points)
+{
+    return points.size;
+}
+
+/**
+ * a merged grid: the sum and count of every pixel, plus their average
+ */
+struct tile_grid: histogram
+{
+    std::vector<float, aligned_allocator<float>> avg;
+    // largest sum, which write_ppm() normalizes by
+    float max_sum;
+    // largest sum of every merge slice, while merging
+    std::vector<float> slice_max;
+
+    explicit tile_grid(std::size_t size = 0):
+        histogram(size), avg(size), max_sum(0.0f),
+        slice_max((size + merge_slice_size - 1) / merge_slice_size)
+    {}
+
+    /**
+     * sets max_sum to the largest of slice_max
+     */
+    void reduce_max()
+    {
+        max_sum = slice_max.empty() ? 0.0f : *std::max_element(slice_max.begin(), slice_max.end());
+    }
+};
+
+/**
+ * turns the sums of pixels [begin, end), a merge slice, into averages and
+ * keeps their maximum in slice_max. Empty pixels have a zero sum, so
+ * dividing them by one instead of skipping them keeps the loop free of
+ * branches.
+ */
+inline void normalize(tile_grid& grid, std::size_t begin, std::size_t end)
+{
+    const float* sum = grid.sum.data();
+    const uint32_t* count = grid.count.data();
+    float* avg = grid.avg.data();
+    float max = sum[begin];
+    for (std::size_t i = begin; i < end; i++)
+    {
+        avg[i] = sum[i] / float(std::max(count[i], 1u));
+        max = sum[i] > max ? sum[i] : max;
+    }
+    grid.slice_max[begin / merge_slice_size] = max;
+}
+
+/**
+ * adds pixels [begin, end) of `partial` to `to` and clears them in `partial`.
+ * A partial of several lanes holds that many histograms of the size of `to`
+ * one after the other (see column_lanes), all added up.
+ */
+inline void add_slice(histogram& to, histogram& partial, std::size_t begin, std::size_t end)
+{
+    float* sum = to.sum.data();
+    uint32_t* count = to.count.data();
+    for (std::size_t lane = 0; lane < partial.size(); lane += to.size())
+    {
+        float* partial_sum = partial.sum.data() + lane;
+        uint32_t* partial_count = partial.count.data() + lane;
+        for (std::size_t i = begin; i < end; i++)
+        {
+            sum[i] += partial_sum[i];
+            count[i] += partial_count[i];
+            partial_sum[i] = 0.0f;
+            partial_count[i] = 0;
+        }
+    }
+}
+
+/**
+ * per-worker partial histograms and the merged grid, allocated once and
+ * reused by every grid() call
+ */
+struct grid_arena
+{
+    std::vector<histogram> partials;
+    tile_grid merged;
+
+    explicit grid_arena(unsigned workers):
+        partials(workers, histogram(grid_size * column_lanes)), merged(grid_size)
+    {}
+};
+
+/**
+ * sums up the partial histograms of `arena` into its merged grid and turns
+ * the sums into averages. The pixel range is split in slices that the pool
+ * workers reduce concurrently, each slice going over all the partials,
+ * clearing them for the next call, and then dividing.
+ */
+inline const tile_grid& merge(grid_arena& arena, thread_pool& pool)
+{
+  std::size_t slices = (grid_size + merge_slice_size - 1) / merge_slice_size;
+  pool.for_each(slices, [&] (std::size_t slice, unsigned) {
+    std::size_t begin = slice * merge_slice_size;
+    std::size_t end = std::min<std::size_t>(grid_size, begin + merge_slice_size);
+    std::fill(arena.merged.sum.begin() + begin, arena.merged.sum.begin() + end, 0.0f);
+    std::fill(arena.merged.count.begin() + begin, arena.merged.count.begin() + end, 0);
+    for (auto& partial : arena.partials) {
+      add_slice(arena.merged, partial, begin, end);
+    }
+    normalize(arena.merged, begin, end);
+  });
+  arena.merged.reduce_max();
+  return arena.merged;
+}
+
+/**
+ * histogram with fixed point sums, for --deterministic. Integer additions
+ * give the same sums in any order, so the grid does not depend on how the
+ * points were split among the workers. `overflow` is set once an amount or
+ * a sum leaves the int64 range, leaving the sums meaningless.
+ */
+struct fixed_histogram
+{
+    std::vector<int64_t, aligned_allocator<int64_t>> sum;
+    std::vector<uint32_t, aligned_allocator<uint32_t>> count;
+    bool overflow;
+
+    explicit fixed_histogram(std::size_t size = 0):
+        sum(size), count(size), overflow(false)
+    {}
+};
+
+inline void add_to_pixel(histogram& hist, uint32_t p, float amount)
+{
+    ++hist.count[p];
+    hist.sum[p] += amount;
+}
+
+inline void add_to_pixel(fixed_histogram& hist, uint32_t p, float amount)
+{
+    ++hist.count[p];
+    // exact in double, so this rounds half away from zero without a call to
+    // llround()
+    double fixed = amount * fixed_scale;
+    if (!(std::fabs(fixed) < fixed_limit))
+    {
+        // also NaN
+        hist.overflow = true;
+        return;
+    }
+    int64_t units = int64_t(fixed < 0 ? fixed - 0.5 : fixed + 0.5);
+    hist.overflow |= __builtin_add_overflow(hist.sum[p], units, &hist.sum[p]);
+}
+
+inline void add_fixed(const tile_geometry& tile, float x, float y, float amount, fixed_histogram& hist)
+{
+    uint32_t px_x, px_y;
+    if (tile_pixel(tile, x, y, px_x, px_y))
+    {
+        add_to_pixel(hist, px_x * tile.pixel_resolution + px_y, amount);
+    }
+}
+
+inline void accumulate(const column_view& points, std::size_t begin, std::size_t end, fixed_histogram& hist)
+{
+    const tile_geometry tile = TILE;
+    for (std::size_t i = begin; i < end; ++i)
+    {
+        add_fixed(tile, points.x[i], points.y[i], points.amount[i], hist);
+    }
+}
+
+inline void accumulate(const std::vector<row>& rows, std::size_t begin, std::size_t end, fixed_histogram& hist)
+{
+    const tile_geometry tile = TILE;
+    for (std::size_t i = begin; i < end; ++i)
+    {
+        add_fixed(tile, rows[i].x, rows[i].y, rows[i].amount, hist);
+    }
+}
+
+/**
+ * grid_arena for --deterministic
+ */
+struct fixed_arena
+{
+    std::vector<fixed_histogram> partials;
+    tile_grid merged;
+
+    explicit fixed_arena(unsigned workers):
+        partials(workers, fixed_histogram(grid_size)), merged(grid_size)
+    {}
+};
+
+/**
+ * merge() for fixed point partials, converting the sums back to floats.
+ * The result only depends on the points, not on the number of workers.
+ * Throws std::overflow_error if a pixel sum left the fixed point range,
+ * with the partials cleared for the next grid.
+ */
+inline const tile_grid& merge(fixed_arena& arena, thread_pool& pool)
+{
+    bool overflow = false;
+    for (auto& partial: arena.partials)
+    {
+        overflow |= partial.overflow;
+        partial.overflow = false;
+    }
+    std::atomic<bool> wrapped(false);
+    std::size_t slices = (grid_size + merge_slice_size - 1) / merge_slice_size;
+    pool.for_each(slices, [&] (std::size_t slice, unsigned) {
+        std::size_t begin = slice * merge_slice_size;
+        std::size_t end = std::min<std::size_t>(grid_size, begin + merge_slice_size);
+        bool slice_wrapped = false;
+        for (std::size_t i = begin; i < end; i++)
+        {
+            int64_t sum = 0;
+            uint32_t count = 0;
+            for (auto& partial: arena.partials)
+            {
+                slice_wrapped |= __builtin_add_overflow(sum, partial.sum[i], &sum);
+                count += partial.count[i];
+                partial.sum[i] = 0;
+                partial.count[i] = 0;
+            }
+            arena.merged.sum[i] = float(sum / fixed_scale);
+            arena.merged.count[i] = count;
+        }
+        if (slice_wrapped)
+        {
+            wrapped = true;
+        }
+        normalize(arena.merged, begin, end);
+    });
+    if (overflow || wrapped)
+    {
+        throw std::overflow_error("pixel sums past 2^47 in --deterministic mode");
+    }
+    arena.merged.reduce_max();
+    return arena.merged;
+}
+
+/**
+ * the pixel and amount of every point inside the tile, computed once for
+ * repeated renders of the same tile (--cache), so that binning just adds
+ * each amount to its pixel. Points outside the tile are left out, in place
+ * of marking them with a sentinel: every uint16_t is a valid pixel of a
+ * 256x256 tile. Only works for tiles of that size.
+ */
+struct pixel_index
+{
+    std::vector<uint16_t, aligned_allocator<uint16_t>> pixels;
+    std::vector<float, aligned_allocator<float>> amounts;
+
+    pixel_index(const column_view& points, thread_pool& pool)
+    {
+        std::size_t chunks = (points.size + grid_chunk_size - 1) / grid_chunk_size;
+        // first the points every chunk keeps, then where they go
+        std::vector<std::size_t> offsets(chunks + 1);
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            pool.for_each(chunks, [&] (std::size_t chunk, unsigned) {
+                std::size_t end = std::min(points.size, (chunk + 1) * grid_chunk_size);
+                std::size_t to = pass ? offsets[chunk] : 0;
+                for (std::size_t i = chunk * grid_chunk_size; i < end; ++i)
+                {
+                    uint32_t px_x, px_y;
+                    if (tile_pixel(TILE, points.x[i], points.y[i], px_x, px_y))
+                    {
+                        if (pass)
+                        {
+                            pixels[to] = px_x * TILE.pixel_resolution + px_y;
+                            amounts[to] = points.amount[i];
+                        }
+                        ++to;
+                    }
+                }
+                if (!pass)
+                {
+                    offsets[chunk + 1] = to;
+                }
+            });
+            if (!pass)
+            {
+                for (std::size_t chunk = 0; chunk < chunks; ++chunk)
+                {
+                    offsets[chunk + 1] += offsets[chunk];
+                }
+                pixels.resize(offsets[chunks]);
+                amounts.resize(offsets[chunks]);
+            }
+        }
+    }
+};
+
+/**
+ * adds the cached points in [begin, end) to the (not yet normalized)
+ * histogram
+ */
+template <typename Histogram>
+void accumulate(const pixel_index& index, std::size_t begin, std::size_t end, Histogram& hist)
+{
+    const uint16_t* pixels = index.pixels.data();
+    const float* amounts = index.amounts.data();
+    for (std::size_t i = begin; i < end; ++i)
+    {
+        add_to_pixel(hist, pixels[i], amounts[i]);
+    }
+}
+
+inline std::size_t point_count(const pixel_index& index)
+{
+    return index.pixels.size();
+}
+
+/**
+ * the cached points counting-sorted by pixel (--csr): the amounts of pixel
+ * p are amounts[offsets[p]] to amounts[offsets[p + 1]], in point order. Any
+ * per-pixel aggregate is then a contiguous reduction, and pixels can be
+ * split among threads without sharing anything.
+ */
+struct pixel_buckets
+{
+    std::vector<std::size_t> offsets;
+    std::vector<float, aligned_allocator<float>> amounts;
+
+    pixel_buckets(const pixel_index& index, thread_pool& pool):
+        amounts(index.pixels.size())
+    {
+        offsets = counting_sort(index.pixels.size(), grid_size,
+                                [&] (std::size_t i) { return index.pixels[i]; },
+                                [&] (std::size_t i, std::size_t to) { amounts[to] = index.amounts[i]; },
+                                pool);
+    }
+};
+
+/**
+ * calls `fn(pixel, begin, end, worker)` with the amounts of every pixel,
+ * the pool workers taking merge slices of pixels in order
+ */
+template <typename Fn>
+void for_each_pixel(const pixel_buckets& buckets, thread_pool& pool, const Fn& fn)
+{
+    std::size_t slices = (grid_size + merge_slice_size - 1) / merge_slice_size;
+    pool.for_each(slices, [&] (std::size_t slice, unsigned worker) {
+        std::size_t end = std::min<std::size_t>(grid_size, (slice + 1) * merge_slice_size);
+        for (std::size_t p = slice * merge_slice_size; p < end; ++p)
+        {
+            const float* amounts = buckets.amounts.data();
+            fn(p, amounts + buckets.offsets[p], amounts + buckets.offsets[p + 1], worker);
+        }
+    });
+}
+
+/**
+ * keeps the largest sum of the merge slice of pixel `p`, pixels of every
+ * slice going in order
+ */
+inline void keep_max(tile_grid& grid, std::size_t p, float sum)
+{
+    float& max = grid.slice_max[p / merge_slice_size];
+    max = p % merge_slice_size == 0 || sum > max ? sum : max;
+}
+
+/**
+ * the grid of bucketed points into `grid`. Every pixel adds up its amounts
+ * in point order, like the serial grid, so the result does not depend on
+ * the number of threads.
+ */
+inline const tile_grid& grid(const pixel_buckets& buckets, thread_pool& pool, tile_grid& grid)
+{
+    for_each_pixel(buckets, pool, [&] (std::size_t p, const float* begin, const float* end, unsigned) {
+        float sum = 0.0f;
+        for (const float* amount = begin; amount != end; ++amount)
+        {
+            sum += *amount;
+        }
+        grid.sum[p] = sum;
+        grid.count[p] = end - begin;
+        grid.avg[p] = sum / float(std::max<uint32_t>(end - begin, 1));
+        keep_max(grid, p, sum);
+    });
+    grid.reduce_max();
+    return grid;
+}
+
+/**
+ * the `q`-th percentile (0 to 100, nearest rank) of the amounts of every
+ * pixel into `grid`, 0 for empty pixels. It goes in both the averages and
+ * the sums, so that write_ppm() renders it. `scratch` holds a buffer per
+ * pool worker.
+ */
+inline const tile_grid& percentile_grid(const pixel_buckets& buckets, thread_pool& pool, float q,
+                                 std::vector<std::vector<float>>& scratch, tile_grid& grid)
+{
+    for_each_pixel(buckets, pool, [&] (std::size_t p, const float* begin, const float* end, unsigned worker) {
+        float value = 0.0f;
+        if (begin != end)
+        {
+            std::vector<float>& amounts = scratch[worker];
+            amounts.assign(begin, end);
+            auto nth = amounts.begin() + std::size_t(q / 100 * (amounts.size() - 1) + 0.5f);
+            std::nth_element(amounts.begin(), nth, amounts.end());
+            value = *nth;
+        }
+        grid.sum[p] = grid.avg[p] = value;
+        grid.count[p] = end - begin;
+        keep_max(grid, p, value);
+    });
+    grid.reduce_max();
+    return grid;
+}
+
+/**
+ * calculates 256x256 grid with avg values, from either rows (AoS) or point
+ * columns (SoA). Every pool worker keeps claiming the next chunk of points
+ * from a shared cursor and bins it into its own partial histogram, so that
+ * workers stuck with slow chunks do not hold the rest back.
+ *
+ * The result lives in `arena` (a grid_arena, or a fixed_arena for
+ * deterministic sums), which must have one partial per pool worker, and is
+ * overwritten by the next call. Nothing is allocated.
+ */
+template <typename Points, typename Arena>
+const tile_grid& grid(const Points& points, thread_pool& pool, Arena& arena)
+{
+    std::size_t count = point_count(points);
+    std::atomic<std::size_t> cursor(0);
+    pool.for_each(pool.size(), [&] (std::size_t, unsigned worker) {
+        for (std::size_t begin = cursor.fetch_add(grid_chunk_size); begin < count;
+             begin = cursor.fetch_add(grid_chunk_size))
+        {
+            accumulate(points, begin, std::min(begin + grid_chunk_size, count), arena.partials[worker]);
+        }
+    });
+    return merge(arena, pool);
+}
+
+/**
+ * grid() that only bins the indexed points in cells overlapping the tile,
+ * so that its cost depends on the points of the tile rather than on all
+ * the points
+ */
+template <typename Arena>
+const tile_grid& grid(const spatial_index& index, thread_pool& pool, Arena& arena)
+{
+    std::vector<std::pair<std::size_t, std::size_t>> chunks;
+    index.query(TILE.bbox, [&] (std::size_t begin, std::size_t end) {
+        for (; begin < end; begin += grid_chunk_size)
+        {
+            chunks.emplace_back(begin, std::min(begin + grid_chunk_size, end));
+        }
+    });
+
+    std::atomic<std::size_t> cursor(0);
+    pool.for_each(pool.size(), [&] (std::size_t, unsigned worker) {
+        for (std::size_t chunk = cursor++; chunk < chunks.size(); chunk = cursor++)
+        {
+            accumulate(index.points(), chunks[chunk].first, chunks[chunk].second, arena.partials[worker]);
+        }
+    });
+    return merge(arena, pool);
+}
+
+/**
+ * calculates the grid while reading the file, feeding each batch of parsed
+ * rows straight into a per-thread histogram, so that memory use does not
+ * depend on the number of rows
+ */
+inline tile_grid stream_grid(const char* filename, thread_pool& pool, std::size_t& rows)
+{
+    grid_arena arena(pool.size());
+    std::vector<std::size_t> counts(pool.size());
+    read_batches(filename, stream_batch_size, pool.size(),
+                 [&] (std::size_t worker, const row* begin, const row* end) {
+        accumulate(begin, end, arena.partials[worker]);
+        counts[worker] += end - begin;
+    });
+
+    rows = 0;
+    for (auto count: counts)
+    {
+        rows += count;
+    }
+    return merge(arena, pool);
+}
+
+/**
+ * how the pool workers are spread over the NUMA nodes in --numa mode: in
+ * contiguous blocks, every node getting at least one worker
+ */
+struct numa_layout
+{
+    std::vector<numa_node> nodes;
+    // node (index into nodes) of every worker
+    std::vector<unsigned> node_of;
+    // workers of every node
+    std::vector<std::vector<unsigned>> workers;
+
+    numa_layout(const std::vector<numa_node>& numa_nodes, unsigned threads):
+        nodes(numa_nodes), workers(numa_nodes.size())
+    {
+        threads = std::max<unsigned>(threads, nodes.size());
+        for (unsigned worker = 0; worker < threads; ++worker)
+        {
+            unsigned node = std::size_t(worker) * nodes.size() / threads;
+            node_of.push_back(node);
+            workers[node].push_back(worker);
+        }
+    }
+
+    unsigned threads() const { return node_of.size(); }
+
+    // CPUs every worker should be pinned to
+    std::vector<std::vector<int>> affinity() const
+    {
+        std::vector<std::vector<int>> cpus;
+        for (unsigned node: node_of)
+        {
+            cpus.push_back(nodes[node].cpus);
+        }
+        return cpus;
+    }
+};
+
+/**
+ * the points split in one partition per NUMA node, each one allocated and
+ * first touched by the workers of its node so that its pages live there
+ */
+struct numa_points
+{
+    std::vector<std::unique_ptr<point_columns>> partitions;
+
+    numa_points(const column_view& points, thread_pool& pool, const numa_layout& layout)
+    {
+        std::size_t nodes = layout.nodes.size();
+        for (std::size_t node = 0; node < nodes; ++node)
+        {
+            partitions.emplace_back(new point_columns);
+        }
+        pool.for_each_worker([&] (std::size_t, unsigned worker) {
+            unsigned node = layout.node_of[worker];
+            if (layout.workers[node].front() == worker)
+            {
+                partitions[node]->resize(points.size * (node + 1) / nodes - points.size * node / nodes);
+            }
+        });
+        pool.for_each_worker([&] (std::size_t, unsigned worker) {
+            unsigned node = layout.node_of[worker];
+            const auto& node_workers = layout.workers[node];
+            std::size_t share = std::find(node_workers.begin(), node_workers.end(), worker) - node_workers.begin();
+            std::size_t size = partitions[node]->size();
+            std::size_t base = points.size * node / nodes;
+            std::size_t end = size * (share + 1) / node_workers.size();
+            for (std::size_t i = size * share / node_workers.size(); i < end; ++i)
+            {
+                row r = { points.x[base + i], points.y[base + i], points.amount[base + i] };
+                partitions[node]->set(i, r);
+            }
+        });
+    }
+};
+
+/**
+ * grid_arena for numa_grid(), with every worker partial first touched by
+ * its worker, plus one partial per node
+ */
+struct numa_arena
+{
+    grid_arena grids;
+    std::vector<histogram> node_partials;
+    std::unique_ptr<std::atomic<std::size_t>[]> point_cursors;
+    std::unique_ptr<std::atomic<std::size_t>[]> slice_cursors;
+
+    numa_arena(thread_pool& pool, const numa_layout& layout):
+        grids(0),
+        node_partials(layout.nodes.size()),
+        point_cursors(new std::atomic<std::size_t>[layout.nodes.size()]),
+        slice_cursors(new std::atomic<std::size_t>[layout.nodes.size()])
+    {
+        grids.partials.resize(pool.size());
+        pool.for_each_worker([&] (std::size_t, unsigned worker) {
+            grids.partials[worker].resize(grid_size * column_lanes);
+            unsigned node = layout.node_of[worker];
+            if (layout.workers[node].front() == worker)
+            {
+                node_partials[node].resize(grid_size);
+            }
+        });
+    }
+};
+
+/**
+ * grid() for points partitioned per NUMA node. Workers only bin points of
+ * their own node's partition, then every node reduces its workers' partials
+ * into a node partial, and only those cross the interconnect in the final
+ * merge.
+ */
+inline const tile_grid& numa_grid(const numa_points& points, thread_pool& pool,
+                           const numa_layout& layout, numa_arena& arena)
+{
+    std::size_t nodes = layout.nodes.size();
+    std::size_t slices = (grid_size + merge_slice_size - 1) / merge_slice_size;
+    for (std::size_t node = 0; node < nodes; ++node)
+    {
+        arena.point_cursors[node] = 0;
+        arena.slice_cursors[node] = 0;
+    }
+
+    pool.for_each_worker([&] (std::size_t, unsigned worker) {
+        unsigned node = layout.node_of[worker];
+        const column_view& partition = points.partitions[node]->view();
+        auto& cursor = arena.point_cursors[node];
+        for (std::size_t begin = cursor.fetch_add(grid_chunk_size); begin < partition.size;
+             begin = cursor.fetch_add(grid_chunk_size))
+        {
+            accumulate(partition, begin, std::min(begin + grid_chunk_size, partition.size),
+                       arena.grids.partials[worker]);
+        }
+    });
+
+    pool.for_each_worker([&] (std::size_t, unsigned worker) {
+        unsigned node = layout.node_of[worker];
+        auto& node_partial = arena.node_partials[node];
+        auto& cursor = arena.slice_cursors[node];
+        for (std::size_t slice = cursor++; slice < slices; slice = cursor++)
+        {
+            std::size_t begin = slice * merge_slice_size;
+            std::size_t end = std::min<std::size_t>(grid_size, begin + merge_slice_size);
+            std::fill(node_partial.sum.begin() + begin, node_partial.sum.begin() + end, 0.0f);
+            std::fill(node_partial.count.begin() + begin, node_partial.count.begin() + end, 0);
+            for (unsigned w: layout.workers[node])
+            {
+                add_slice(node_partial, arena.grids.partials[w], begin, end);
+            }
+        }
+    });
+
+    pool.for_each(slices, [&] (std::size_t slice, unsigned) {
+        std::size_t begin = slice * merge_slice_size;
+        std::size_t end = std::min<std::size_t>(grid_size, begin + merge_slice_size);
+        tile_grid& merged = arena.grids.merged;
+        std::fill(merged.sum.begin() + begin, merged.sum.begin() + end, 0.0f);
+        std::fill(merged.count.begin() + begin, merged.count.begin() + end, 0);
+        for (std::size_t i = begin; i < end; i++)
+        {
+            for (const auto& node_partial: arena.node_partials)
+            {
+                merged.sum[i] += node_partial.sum[i];
+                merged.count[i] += node_partial.count[i];
+            }
+        }
+        normalize(merged, begin, end);
+    });
+    arena.grids.merged.reduce_max();
+    return arena.grids.merged;
+}
+
+/**
+ * copies `points` into `sorted` ordered by the Morton code of their pixel,
+ * points outside the tile last, so that grid() updates the histogram in
+ * small neighbourhoods instead of all over it. The sort is stable, so every
+ * pixel still gets its amounts in the same order.
+ */
+inline void sort_points(const column_view& points, thread_pool& pool, point_columns& sorted)
+{
+    // one past the largest Morton code of the tile, which interleaves pixel
+    // coordinates of `bits` bits even if the size is not a power of two
+    unsigned bits = 0;
+    while ((1u << bits) < TILE.pixel_resolution)
+    {
+        ++bits;
+    }
+    const uint32_t outside = 1u << (2 * bits);
+    const unsigned key_bits = 2 * bits + 1;
+    std::size_t chunks = (points.size + grid_chunk_size - 1) / grid_chunk_size;
+    std::vector<uint32_t> keys(points.size);
+    std::vector<uint32_t> order(points.size);
+    pool.for_each(chunks, [&] (std::size_t chunk, unsigned) {
+        std::size_t end = std::min(points.size, (chunk + 1) * grid_chunk_size);
+        for (std::size_t i = chunk * grid_chunk_size; i < end; ++i)
+        {
+            uint32_t x, y;
+            keys[i] = tile_pixel(TILE, points.x[i], points.y[i], x, y) ? morton_code(x, y) : outside;
+            order[i] = i;
+        }
+    });
+    radix_sort(keys, order, key_bits, pool);
+
+    sorted.resize(0);
+    sorted.resize(points.size);
+    pool.for_each(chunks, [&] (std::size_t chunk, unsigned) {
+        std::size_t end = std::min(points.size, (chunk + 1) * grid_chunk_size);
+        for (std::size_t i = chunk * grid_chunk_size; i < end; ++i)
+        {
+            row r = { points.x[order[i]], points.y[order[i]], points.amount[order[i]] };
+            sorted.set(i, r);
+        }
+    });
+}
+
+/**
+ * grids of a tile and of its sub tiles down to `levels` zoom levels below
+ * it, one per zoom level covering the whole tile: level l is a grid of
+ * 2^l x 2^l sub tiles of `tile_pixels` pixels a side. The points are only
+ * binned in the finest one, which the caller keeps, and every coarser level
+ * sums 2x2 pixels of the one below.
+ *
+ * Sub tiles are cut from the pixel grid of the top tile, while rendering a
+ * sub tile with --tile bins against its own float bbox, whose edges can be
+ * a float step away from the top tile's pixel edges: points that close to a
+ * pixel edge land in the neighbouring pixel. torque-check bounds the share
+ * of points that move.
+ */
+struct tile_pyramid
+{
+    uint32_t tile_pixels;
+    // levels [0, levels), the finest one left out
+    std::vector<histogram> coarse;
+
+    tile_pyramid(uint32_t tile_pixels, int levels):
+        tile_pixels(tile_pixels)
+    {
+        for (int level = 0; level < levels; ++level)
+        {
+            uint32_t size = tile_pixels << level;
+            coarse.emplace_back(std::size_t(size) * size);
+        }
+    }
+
+    int levels() const { return coarse.size(); }
+
+    uint32_t level_pixels(int level) const { return tile_pixels << level; }
+};
+
+/**
+ * sums every 2x2 pixels of `fine`, a grid of `size` x `size` pixels, into
+ * `coarse`, the pool workers taking rows of coarse pixels
+ */
+inline void downsample(const histogram& fine, uint32_t size, histogram& coarse, thread_pool& pool)
+{
+    const uint32_t half = size / 2;
+    pool.for_each(half, [&] (std::size_t x, unsigned) {
+        const float* sum = fine.sum.data() + 2 * x * size;
+        const uint32_t* count = fine.count.data() + 2 * x * size;
+        float* to_sum = coarse.sum.data() + x * half;
+        uint32_t* to_count = coarse.count.data() + x * half;
+        for (uint32_t y = 0; y < half; ++y)
+        {
+            to_sum[y] = (sum[2 * y] + sum[2 * y + 1]) + (sum[size + 2 * y] + sum[size + 2 * y + 1]);
+            to_count[y] = count[2 * y] + count[2 * y + 1] + count[size + 2 * y] + count[size + 2 * y + 1];
+        }
+    });
+}
+
+/**
+ * fills the coarse levels of `pyramid` from `finest`, its finest level
+ */
+inline void build_pyramid(const histogram& finest, thread_pool& pool, tile_pyramid& pyramid)
+{
+    const histogram* fine = &finest;
+    for (int level = pyramid.levels(); level-- > 0; )
+    {
+        downsample(*fine, pyramid.level_pixels(level + 1), pyramid.coarse[level], pool);
+        fine = &pyramid.coarse[level];
+    }
+}
+
+/**
+ * what band_grid() keeps between calls: the pixel of every point, then
+ * pixels and amounts by band, and the histogram
+ */
+struct band_arena
+{
+    std::vector<uint32_t> point_pixels;
+    std::vector<uint32_t> band_pixels;
+    std::vector<float> band_amounts;
+    histogram merged;
+
+    band_arena():
+        merged(grid_size)
+    {}
+};
+
+/**
+ * the (not yet normalized) histogram of a large tile, such as the finest
+ * level of a pyramid, without a partial grid per worker: the pool workers
+ * find the pixel of chunks of points, the points are counting-sorted into
+ * bands of band_rows pixel rows, and every worker then bins whole bands.
+ * Sums add up in point order, so they do not depend on the threads either.
+ */
+inline const histogram& band_grid(const column_view& points, thread_pool& pool, band_arena& arena)
+{
+    const uint32_t pixels = TILE.pixel_resolution;
+    const uint32_t outside = grid_size;
+    std::vector<uint32_t>& point_pixels = arena.point_pixels;
+    point_pixels.resize(points.size);
+    arena.band_pixels.resize(points.size);
+    arena.band_amounts.resize(points.size);
+    std::size_t chunks = (points.size + grid_chunk_size - 1) / grid_chunk_size;
+    pool.for_each(chunks, [&] (std::size_t chunk, unsigned) {
+        std::size_t end = std::min(points.size, (chunk + 1) * grid_chunk_size);
+        for (std::size_t i = chunk * grid_chunk_size; i < end; ++i)
+        {
+            uint32_t px_x, px_y;
+            point_pixels[i] = tile_pixel(TILE, points.x[i], points.y[i], px_x, px_y) ?
+                px_x * pixels + px_y : outside;
+        }
+    });
+
+    // points outside the tile go to a last band, left out
+    const std::size_t band_pixels = std::size_t(band_rows) * pixels;
+    const std::size_t bands = (pixels + band_rows - 1) / band_rows;
+    std::vector<std::size_t> offsets = counting_sort(points.size, bands + 1,
+        [&] (std::size_t i) { return point_pixels[i] == outside ? bands : point_pixels[i] / band_pixels; },
+        [&] (std::size_t i, std::size_t to) {
+            arena.band_pixels[to] = point_pixels[i];
+            arena.band_amounts[to] = points.amount[i];
+        },
+        pool);
+
+    histogram& grid = arena.merged;
+    pool.for_each(bands, [&] (std::size_t band, unsigned) {
+        std::size_t begin = band * band_pixels;
+        std::size_t end = std::min<std::size_t>(grid_size, begin + band_pixels);
+        std::fill(grid.sum.begin() + begin, grid.sum.begin() + end, 0.0f);
+        std::fill(grid.count.begin() + begin, grid.count.begin() + end, 0);
+        for (std::size_t i = offsets[band]; i < offsets[band + 1]; ++i)
+        {
+            grid.sum[arena.band_pixels[i]] += arena.band_amounts[i];
+            ++grid.count[arena.band_pixels[i]];
+        }
+    });
+    return grid;
+}
+
+/**
+ * the grid of sub tile (`x`, `y`) of `level`, a grid of `level_pixels` a
+ * side, into `tile`. x goes along the first pixel coordinate (north) and y
+ * along the second one (east), both from the tile's min corner.
+ */
+inline void sub_tile(const histogram& level, uint32_t level_pixels, uint32_t tile_pixels, uint32_t x, uint32_t y,
+              tile_grid& tile)
+{
+    for (uint32_t px_x = 0; px_x < tile_pixels; ++px_x)
+    {
+        std::size_t from = std::size_t(x * tile_pixels + px_x) * level_pixels + y * tile_pixels;
+        std::copy(&level.sum[from], &level.sum[from] + tile_pixels, &tile.sum[px_x * tile_pixels]);
+        std::copy(&level.count[from], &level.count[from] + tile_pixels, &tile.count[px_x * tile_pixels]);
+    }
+    for (std::size_t begin = 0; begin < tile.size(); begin += merge_slice_size)
+    {
+        normalize(tile, begin, std::min(tile.size(), begin + merge_slice_size));
+    }
+    tile.reduce_max();
+}
+
+/**
+ * bbox of tile `x`, `y` of zoom level `zoom` in point coordinates, as in
+ * tile_geometry: (min northing, min easting, max northing, max easting)
+ */
+inline void tile_bbox(int zoom, uint32_t x, uint32_t y, float bbox[4])
+{
+    double mercator[4];
+    mercator_tile_bbox(zoom, x, y, mercator);
+    bbox[0] = mercator[1];
+    bbox[1] = mercator[0];
+    bbox[2] = mercator[3];
+    bbox[3] = mercator[2];
+}
+
+/**
+ * a list of tiles of one zoom level rendered together (--tiles): every
+ * point is routed to its tile once, then every tile is binned on its own.
+ * Tiles are found through an open addressing map from their coordinates to
+ * their slot, so the list can be sparse.
+ */
+struct tile_batch
+{
+    // slot of points in none of the tiles
+    static const uint32_t none = ~0u;
+
+    int zoom;
+    uint32_t pixels;
+    // coordinates, geometry and grid of every tile, by slot
+    std::vector<uint32_t> xs;
+    std::vector<uint32_t> ys;
+    std::vector<tile_geometry> tiles;
+    std::vector<tile_grid> grids;
+    // tile and pixel of every point, then pixels and amounts by tile, for
+    // batch_grid()
+    std::vector<uint32_t> point_slots;
+    std::vector<uint32_t> point_pixels;
+    std::vector<uint32_t> tile_pixels;
+    std::vector<float> tile_amounts;
+
+    /**
+     * the tiles ("zoom/x/y") rendered at `pixels` x `pixels`. Throws
+     * std::invalid_argument for bad tiles, or tiles of different zoom
+     * levels.
+     */
+    tile_batch(const std::vector<std::string>& list, uint32_t pixels):
+        zoom(-1), pixels(pixels)
+    {
+        std::set<uint64_t> seen;
+        for (const std::string& tile: list)
+        {
+            int tile_zoom;
+            uint32_t x, y;
+            parse_tile(tile, tile_zoom, x, y);
+            if (zoom >= 0 && tile_zoom != zoom)
+            {
+                throw std::invalid_argument("tiles of different zoom levels: " + tile);
+            }
+            zoom = tile_zoom;
+            if (!seen.insert(uint64_t(x) << 32 | y).second)
+            {
+                continue;
+            }
+            tile_geometry geometry = { {}, float(pixels / mercator_tile_size(zoom)), pixels };
+            tile_bbox(zoom, x, y, geometry.bbox);
+            xs.push_back(x);
+            ys.push_back(y);
+            tiles.push_back(geometry);
+            grids.emplace_back(std::size_t(pixels) * pixels);
+        }
+        if (tiles.empty())
+        {
+            throw std::invalid_argument("no tiles to render");
+        }
+        _tile_size = mercator_tile_size(zoom);
+        _tile_size_inv = 1.0 / _tile_size;
+        index();
+    }
+
+    std::size_t size() const { return tiles.size(); }
+
+    /**
+     * slot of tile (`x`, `y`), or none
+     */
+    uint32_t find(uint32_t x, uint32_t y) const
+    {
+        uint64_t key = uint64_t(x) << 32 | y;
+        for (std::size_t i = hash(key); ; i = (i + 1) & (_keys.size() - 1))
+        {
+            if (_keys[i] == key || _keys[i] == empty)
+            {
+                return _keys[i] == key ? _slots[i] : none;
+            }
+        }
+    }
+
+    /**
+     * slot of the tile of point (x, y), setting `pixel` to its pixel in the
+     * tile, or none if it is in none of them. Tile columns go east along y
+     * and tile rows south along x. The pixel test is the one of
+     * the kernels, against the float bbox of the tile, so a point lands
+     * where rendering its tile alone would put it.
+     */
+    uint32_t route(float x, float y, uint32_t& pixel) const
+    {
+        double u = (double(y) + mercator_extent) * _tile_size_inv;
+        double v = (mercator_extent - double(x)) * _tile_size_inv;
+        double tiles = std::ldexp(1.0, zoom);
+        if (!(u >= 0 && v >= 0 && u < tiles && v < tiles))
+        {
+            return none;
+        }
+        uint32_t tile_x = uint32_t(u), tile_y = uint32_t(v);
+        uint32_t slot = route(tile_x, tile_y, x, y, pixel);
+        if (slot != none)
+        {
+            return slot;
+        }
+
+        // float bboxes move the tile edges a little, so points right next
+        // to an edge may belong to the neighbouring tile
+        const double slack = edge_slack * _tile_size_inv;
+        double fraction_x = u - tile_x, fraction_y = v - tile_y;
+        int dx = fraction_x < slack ? -1 : fraction_x > 1 - slack ? 1 : 0;
+        int dy = fraction_y < slack ? -1 : fraction_y > 1 - slack ? 1 : 0;
+        if (dx)
+        {
+            slot = route(tile_x + dx, tile_y, x, y, pixel);
+        }
+        if (dy && slot == none)
+        {
+            slot = route(tile_x, tile_y + dy, x, y, pixel);
+        }
+        if (dx && dy && slot == none)
+        {
+            slot = route(tile_x + dx, tile_y + dy, x, y, pixel);
+        }
+        return slot;
+    }
+
+private:
+    // meters from a tile edge within which float rounding may move points
+    // to the neighbouring tile
+    static constexpr double edge_slack = 4.0;
+    static const uint64_t empty = ~uint64_t(0);
+
+    uint32_t route(uint32_t tile_x, uint32_t tile_y, float x, float y, uint32_t& pixel) const
+    {
+        uint32_t slot = find(tile_x, tile_y);
+        uint32_t px_x, px_y;
+        if (slot != none && tile_pixel(tiles[slot], x, y, px_x, px_y))
+        {
+            pixel = px_x * pixels + px_y;
+            return slot;
+        }
+        return none;
+    }
+
+    std::size_t hash(uint64_t key) const
+    {
+        return (key * 0x9e3779b97f4a7c15ull) >> (64 - _bits);
+    }
+
+    /**
+     * builds the map of tiles to slots, at most half full
+     */
+    void index()
+    {
+        _bits = 1;
+        while ((std::size_t(1) << _bits) < 2 * tiles.size())
+        {
+            ++_bits;
+        }
+        _keys.assign(std::size_t(1) << _bits, empty);
+        _slots.assign(_keys.size(), none);
+        for (uint32_t slot = 0; slot < tiles.size(); ++slot)
+        {
+            uint64_t key = uint64_t(xs[slot]) << 32 | ys[slot];
+            std::size_t i = hash(key);
+            while (_keys[i] != empty)
+            {
+                i = (i + 1) & (_keys.size() - 1);
+            }
+            _keys[i] = key;
+            _slots[i] = slot;
+        }
+    }
+
+    double _tile_size;
+    double _tile_size_inv;
+    unsigned _bits;
+    std::vector<uint64_t> _keys;
+    std::vector<uint32_t> _slots;
+};
+
+const uint32_t tile_batch::none;
+const uint64_t tile_batch::empty;
+constexpr double tile_batch::edge_slack;
+
+/**
+ * the grids of every tile of `batch` in one scan of the points: the pool
+ * workers route chunks of points to their tile and pixel, the routed points
+ * are counting-sorted by tile, and every worker then bins whole tiles, so
+ * that no partial grids need merging. Sums add up in point order.
+ */
+inline void batch_grid(const column_view& points, thread_pool& pool, tile_batch& batch)
+{
+    std::vector<uint32_t>& slots = batch.point_slots;
+    std::vector<uint32_t>& pixels = batch.point_pixels;
+    std::vector<uint32_t>& tile_pixels = batch.tile_pixels;
+    std::vector<float>& tile_amounts = batch.tile_amounts;
+    slots.resize(points.size);
+    pixels.resize(points.size);
+    tile_pixels.resize(points.size);
+    tile_amounts.resize(points.size);
+    std::size_t chunks = (points.size + grid_chunk_size - 1) / grid_chunk_size;
+    pool.for_each(chunks, [&] (std::size_t chunk, unsigned) {
+        std::size_t end = std::min(points.size, (chunk + 1) * grid_chunk_size);
+        for (std::size_t i = chunk * grid_chunk_size; i < end; ++i)
+        {
+            slots[i] = batch.route(points.x[i], points.y[i], pixels[i]);
+        }
+    });
+
+    // points in no tile go to a last bucket, left out
+    const std::size_t tiles = batch.size();
+    std::vector<std::size_t> offsets = counting_sort(points.size, tiles + 1,
+        [&] (std::size_t i) { return std::min<std::size_t>(slots[i], tiles); },
+        [&] (std::size_t i, std::size_t to) { tile_pixels[to] = pixels[i]; tile_amounts[to] = points.amount[i]; },
+        pool);
+
+    pool.for_each(tiles, [&] (std::size_t slot, unsigned) {
+        tile_grid& grid = batch.grids[slot];
+        std::fill(grid.sum.begin(), grid.sum.end(), 0.0f);
+        std::fill(grid.count.begin(), grid.count.end(), 0);
+        for (std::size_t i = offsets[slot]; i < offsets[slot + 1]; ++i)
+        {
+            grid.sum[tile_pixels[i]] += tile_amounts[i];
+            ++grid.count[tile_pixels[i]];
+        }
+        for (std::size_t begin = 0; begin < grid.size(); begin += merge_slice_size)
+        {
+            normalize(grid, begin, std::min(grid.size(), begin + merge_slice_size));
+        }
+        grid.reduce_max();
+    });
+}
+
+/**
+ * text of every gray level followed by a space, padded to 4 bytes
+ */
+struct gray_texts
+{
+    char text[256][4];
+    uint32_t length[256];
+
+    gray_texts()
+    {
+        for (uint32_t value = 0; value < 256; ++value)
+        {
+            char digits[8];
+            length[value] = std::sprintf(digits, "%u ", value);
+            std::memcpy(text[value], digits, 4);
+        }
+    }
+};
+
+/**
+ * gray levels of a grid in image order, rows going top down, mapping the
+ * sums normalized by the largest one with `ramp`
+ */
+inline void gray_levels(const tile_grid& grid, const color_ramp& ramp, uint8_t* levels)
+{
+    const uint32_t size = TILE.pixel_resolution;
+    float max = grid.max_sum;
+    for(uint32_t row = 0; row < size; ++row) {
+        const float* sums = grid.sum.data() + (size - 1 - row) * size;
+        for(uint32_t y = 0; y < size; ++y) {
+            levels[row * size + y] = ramp(sums[y]/max);
+        }
+    }
+}
+
+/**
+ * writes [data, end) to file descriptor `fd`, exiting if that fails
+ */
+inline void write_out(int fd, const char* data, const char* end)
+{
+    while (data != end) {
+        ssize_t written = ::write(fd, data, end - data);
+        if (written < 0 && errno != EINTR) {
+            std::cerr << "cannot write the image: " << std::strerror(errno) << std::endl;
+            exit(-1);
+        }
+        data += std::max<ssize_t>(written, 0);
+    }
+}
+
+/**
+ * writes a grid to `fd` as a text (P2) graymap, or as a binary (P5) one
+ * with `binary`, mapping the sums normalized by the largest one to gray
+ * levels with `ramp`. The image is formatted into a single buffer, copying
+ * the text of every value from a table, and goes out with one write().
+ */
+inline void write_ppm(const tile_grid& grid, const color_ramp& ramp, bool binary, int fd = STDOUT_FILENO) {
+    const uint32_t size = TILE.pixel_resolution;
+    static const gray_texts texts;
+
+    // text: up to 4 bytes per value plus the newlines, and the header
+    std::vector<char> buffer(std::size_t(size) * (binary ? size : 4 * size + 1) + 64);
+    char* out = buffer.data();
+    // P5 samples are single bytes, so the max gray level must be below 256
+    out += std::sprintf(out, "%s\n%u %u\n%u\n", binary ? "P5" : "P2", size, size, binary ? 255 : 256);
+
+    // gray levels in image order, straight into the buffer for P5
+    std::vector<uint8_t> text_levels(binary ? 0 : grid_size);
+    uint8_t* levels = binary ? reinterpret_cast<uint8_t*>(out) : text_levels.data();
+    gray_levels(grid, ramp, levels);
+
+    if (binary) {
+        out += grid_size;
+    } else {
+        for(int i = 0; i < grid_size; ++i) {
+            std::memcpy(out, texts.text[levels[i]], 4);
+            out += texts.length[levels[i]];
+            if (i % size == size - 1) {
+                *out++ = '\n';
+            }
+        }
+    }
+
+    write_out(fd, buffer.data(), out);
+}
+
+/**
+ * the PNG of a grid: its gray levels, or with `rgba` the levels as gray
+ * colors and pixels without points transparent, so that tiles can go over
+ * a base map
+ */
+inline void encode_png(const tile_grid& grid, const color_ramp& ramp, png_compression compression, bool rgba,
+                std::vector<uint8_t>& png)
+{
+    const uint32_t size = TILE.pixel_resolution;
+    std::vector<uint8_t> levels(grid_size);
+    gray_levels(grid, ramp, levels.data());
+
+    std::vector<uint8_t> pixels;
+    if (rgba) {
+        pixels.resize(std::size_t(grid_size) * 4);
+        for(uint32_t row = 0; row < size; ++row) {
+            const uint32_t* counts = grid.count.data() + (size - 1 - row) * size;
+            for(uint32_t y = 0; y < size; ++y) {
+                uint8_t* pixel = &pixels[(std::size_t(row) * size + y) * 4];
+                pixel[0] = pixel[1] = pixel[2] = levels[row * size + y];
+                pixel[3] = counts[y] ? 255 : 0;
+            }
+        }
+    }
+
+    std::vector<uint8_t> scratch;
+    png.clear();
+    encode_png(rgba ? pixels.data() : levels.data(), size, size, rgba ? 4 : 1, compression, png, scratch);
+}
+
+/**
+ * writes a grid to `fd` as a PNG, see encode_png()
+ */
+inline void write_png(const tile_grid& grid, const color_ramp& ramp, png_compression compression, bool rgba,
+               int fd = STDOUT_FILENO)
+{
+    std::vector<uint8_t> png;
+    encode_png(grid, ramp, compression, rgba, png);
+    const char* data = reinterpret_cast<const char*>(png.data());
+    write_out(fd, data, data + png.size());
+}
+
+/**
+ * renders tile `tile` ("zoom/x/y", the default one if empty) at `pixels` x
+ * `pixels` from now on. Throws std::invalid_argument for bad tiles.
+ */
+inline void set_tile(const std::string& tile, uint32_t pixels)
+{
+    if (!tile.empty())
+    {
+        uint32_t x, y;
+        parse_tile(tile, tile_zoom, x, y);
+        tile_bbox(tile_zoom, x, y, TILE.bbox);
+    }
+    else
+    {
+        std::copy(BBOX, BBOX + 4, TILE.bbox);
+        tile_zoom = BBOX_ZOOM;
+    }
+    TILE.pixel_resolution = pixels;
+    // the default tile keeps its own scale at its default size
+    TILE.resolution_inv = tile.empty() && pixels == pixel_resolution ?
+        resolution_inv : float(pixels / mercator_tile_size(tile_zoom));
+    grid_size = pixels * pixels;
+}
+
+/**
+ * bins `levels` zoom levels finer than the tile from now on, at exactly
+ * 2^levels times its scale so that every pixel falls in one of the tile
+ */
+inline void refine_tile(int levels)
+{
+    TILE.pixel_resolution <<= levels;
+    TILE.resolution_inv = std::ldexp(TILE.resolution_inv, levels);
+    grid_size = TILE.pixel_resolution * TILE.pixel_resolution;
+}
+
+#endif
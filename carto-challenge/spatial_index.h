@@ -0,0 +1,141 @@
+/*
+ * Spatial index over point columns, to render many tiles from the same
+ * points without scanning all of them for every tile.
+ *
+ * The points are counting-sorted into the web mercator tiles of one zoom
+ * level (the cells), keeping the order of the points within every cell.
+ * Only cells covered by the points are kept, column after column, so the
+ * points of the cells in one column and a range of rows are contiguous.
+ */
+
+#ifndef CARTO_SPATIAL_INDEX_H
+#define CARTO_SPATIAL_INDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "mercator.h"
+#include "morton.h"
+#include "points.h"
+#include "thread_pool.h"
+
+class spatial_index
+{
+public:
+    /**
+     * indexes `points` in the tiles of `zoom`, or of the deepest zoom level
+     * below it that covers the points with at most `max_cells` cells
+     */
+    spatial_index(const column_view& points, thread_pool& pool, int zoom, std::size_t max_cells):
+        _first_column(0), _first_row(0), _columns(1), _rows(1)
+    {
+        float bounds[4] = {
+            std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(),
+            -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity()
+        };
+        for (std::size_t i = 0; i < points.size; ++i)
+        {
+            if (std::isfinite(points.x[i]) && std::isfinite(points.y[i]))
+            {
+                bounds[0] = std::min(bounds[0], points.x[i]);
+                bounds[1] = std::min(bounds[1], points.y[i]);
+                bounds[2] = std::max(bounds[2], points.x[i]);
+                bounds[3] = std::max(bounds[3], points.y[i]);
+            }
+        }
+
+        for (_zoom = zoom; ; --_zoom)
+        {
+            _cell_size = mercator_tile_size(_zoom);
+            if (bounds[0] <= bounds[2])
+            {
+                _first_column = cell(bounds[0]);
+                _first_row = cell(bounds[1]);
+                _columns = cell(bounds[2]) - _first_column + 1;
+                _rows = cell(bounds[3]) - _first_row + 1;
+            }
+            if (_zoom == 0 || std::size_t(_columns * _rows) <= max_cells)
+            {
+                break;
+            }
+        }
+
+        _points.resize(points.size);
+        _offsets = counting_sort(points.size, _columns * _rows,
+                                 [&] (std::size_t i) { return key(points.x[i], points.y[i]); },
+                                 [&] (std::size_t i, std::size_t to) {
+                                     row r = { points.x[i], points.y[i], points.amount[i] };
+                                     _points.set(to, r);
+                                 },
+                                 pool);
+    }
+
+    spatial_index(const spatial_index&) = delete;
+    spatial_index& operator=(const spatial_index&) = delete;
+
+    int zoom() const { return _zoom; }
+    std::size_t cells() const { return _columns * _rows; }
+
+    /**
+     * the indexed points, sorted by cell
+     */
+    const column_view& points() const { return _points.view(); }
+
+    /**
+     * calls `fn(begin, end)` with the ranges of points() in cells that
+     * overlap `bbox` (min x, min y, max x, max y). Points in those ranges
+     * may still fall outside of it.
+     */
+    template <typename Fn>
+    void query(const float* bbox, const Fn& fn) const
+    {
+        int64_t first_column = std::max<int64_t>(cell(bbox[0]) - _first_column, 0);
+        int64_t last_column = std::min<int64_t>(cell(bbox[2]) - _first_column, _columns - 1);
+        int64_t first_row = std::max<int64_t>(cell(bbox[1]) - _first_row, 0);
+        int64_t last_row = std::min<int64_t>(cell(bbox[3]) - _first_row, _rows - 1);
+        for (int64_t column = first_column; column <= last_column && first_row <= last_row; ++column)
+        {
+            std::size_t begin = _offsets[column * _rows + first_row];
+            std::size_t end = _offsets[column * _rows + last_row + 1];
+            if (begin != end)
+            {
+                fn(begin, end);
+            }
+        }
+    }
+
+private:
+    // cell column or row of a coordinate, clamped to stay within int64_t
+    int64_t cell(double coordinate) const
+    {
+        double cell = std::floor((coordinate + mercator_extent) / _cell_size);
+        return int64_t(std::max(-1e18, std::min(cell, 1e18)));
+    }
+
+    // cell of a point, clamped to the indexed ones. NaN goes to the first.
+    std::size_t key(float x, float y) const
+    {
+        if (std::isnan(x) || std::isnan(y))
+        {
+            return 0;
+        }
+        int64_t column = std::min<int64_t>(std::max<int64_t>(cell(x) - _first_column, 0), _columns - 1);
+        int64_t row = std::min<int64_t>(std::max<int64_t>(cell(y) - _first_row, 0), _rows - 1);
+        return column * _rows + row;
+    }
+
+    int _zoom;
+    double _cell_size;
+    int64_t _first_column;
+    int64_t _first_row;
+    int64_t _columns;
+    int64_t _rows;
+    // where the points of every cell start, followed by the point count
+    std::vector<std::size_t> _offsets;
+    point_columns _points;
+};
+
+#endif
@@ -0,0 +1,328 @@
+/*
+ * Persistent work-stealing thread pool.
+ *
+ * Every worker owns a task deque: it takes its own tasks from the back and,
+ * once it runs out, steals from the front of the other workers' deques.
+ * Tasks receive the index of the worker running them, so callers can keep
+ * per-worker state (like partial histograms) without any locking.
+ *
+ * Tasks are plain function pointers with a context and the deques are ring
+ * buffers that only grow, so once warmed up the pool runs tasks without
+ * allocating any memory.
+ *
+ * Workers can be pinned to sets of CPUs, and tasks can be sent to a given
+ * worker so that they are never stolen, for work that must run close to
+ * some memory.
+ */
+
+#ifndef CARTO_THREAD_POOL_H
+#define CARTO_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "numa.h"
+
+class thread_pool
+{
+public:
+    struct task
+    {
+        void (*fn)(void* context, std::size_t index, unsigned worker);
+        void* context;
+        std::size_t index;
+    };
+
+    /**
+     * starts `threads` workers, or one per hardware thread if 0. Worker i is
+     * pinned to the CPUs in affinity[i], if given. Throws std::runtime_error
+     * if a worker cannot be pinned.
+     */
+    explicit thread_pool(unsigned threads = 0, const std::vector<std::vector<int>>& affinity = {}):
+        _queued(0), _pending(0), _next(0), _stop(false)
+    {
+        if (!threads)
+        {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        _cpus.reset(new std::atomic<int>[threads]);
+        for (unsigned i = 0; i < threads; ++i)
+        {
+            _cpus[i] = -1;
+            _queues.emplace_back(new queue);
+        }
+        for (unsigned i = 0; i < threads; ++i)
+        {
+            _threads.emplace_back(&thread_pool::work, this, i);
+            if (i < affinity.size() && !affinity[i].empty() && !pin_thread(_threads.back(), affinity[i]))
+            {
+                stop();
+                throw std::runtime_error("cannot pin worker " + std::to_string(i) + " to its CPUs");
+            }
+        }
+    }
+
+    ~thread_pool()
+    {
+        stop();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    // _queues is complete before the first worker starts, while _threads
+    // still grows as the workers already call size()
+    unsigned size() const { return _queues.size(); }
+
+    /**
+     * the CPU `worker` was on when it last finished a task, -1 if unknown
+     */
+    int worker_cpu(unsigned worker) const { return _cpus[worker]; }
+
+    /**
+     * queues a task. Tasks submitted from a worker go to its own deque, the
+     * rest are spread round robin.
+     */
+    void submit(const task& t)
+    {
+        unsigned target = current().pool == this ? current().worker : _next++ % size();
+        {
+            // count it first, so that it is never taken before being counted
+            std::lock_guard<std::mutex> lock(_mutex);
+            ++_queued;
+            ++_pending;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_queues[target]->mutex);
+            _queues[target]->tasks.push(t);
+        }
+        _wake.notify_one();
+    }
+
+    /**
+     * queues a task that only `worker` may run
+     */
+    void submit_to(unsigned worker, const task& t)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            ++_queues[worker]->pinned_count;
+            ++_pending;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_queues[worker]->mutex);
+            _queues[worker]->pinned.push(t);
+        }
+        // notify_one could wake a worker that is not allowed to run it
+        _wake.notify_all();
+    }
+
+    /**
+     * blocks until every submitted task has run. Must not be called from a
+     * worker.
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [this] { return _pending == 0; });
+    }
+
+    /**
+     * runs `fn(i, worker)` for i in [0, n) and waits for all of them
+     */
+    template <typename Fn>
+    void for_each(std::size_t n, const Fn& fn)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            task t = { &call<Fn>, const_cast<Fn*>(&fn), i };
+            submit(t);
+        }
+        wait();
+    }
+
+    /**
+     * runs `fn(worker, worker)` once on every worker and waits for all of them
+     */
+    template <typename Fn>
+    void for_each_worker(const Fn& fn)
+    {
+        for (unsigned i = 0; i < size(); ++i)
+        {
+            task t = { &call<Fn>, const_cast<Fn*>(&fn), i };
+            submit_to(i, t);
+        }
+        wait();
+    }
+
+private:
+    template <typename Fn>
+    static void call(void* context, std::size_t index, unsigned worker)
+    {
+        (*static_cast<const Fn*>(context))(index, worker);
+    }
+
+    /**
+     * double ended ring buffer of tasks, growing when full
+     */
+    struct ring
+    {
+        std::vector<task> tasks;
+        std::size_t head;
+        std::size_t count;
+
+        ring():
+            tasks(64), head(0), count(0)
+        {}
+
+        bool empty() const { return count == 0; }
+
+        void push(const task& t)
+        {
+            if (count == tasks.size())
+            {
+                std::vector<task> grown(tasks.size() * 2);
+                for (std::size_t i = 0; i < count; ++i)
+                {
+                    grown[i] = tasks[(head + i) % tasks.size()];
+                }
+                tasks.swap(grown);
+                head = 0;
+            }
+            tasks[(head + count++) % tasks.size()] = t;
+        }
+
+        task pop_back()
+        {
+            return tasks[(head + --count) % tasks.size()];
+        }
+
+        task pop_front()
+        {
+            task t = tasks[head];
+            head = (head + 1) % tasks.size();
+            --count;
+            return t;
+        }
+    };
+
+    struct queue
+    {
+        std::mutex mutex;
+        ring tasks;
+        // tasks sent to this worker with submit_to()
+        ring pinned;
+        std::atomic<std::size_t> pinned_count;
+
+        queue():
+            pinned_count(0)
+        {}
+    };
+
+    struct worker_id
+    {
+        const thread_pool* pool;
+        unsigned worker;
+    };
+
+    // pool and index of the worker running on this thread, if any
+    static worker_id& current()
+    {
+        static thread_local worker_id id = { nullptr, 0 };
+        return id;
+    }
+
+    bool pop(unsigned worker, task& t)
+    {
+        {
+            queue& own = *_queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.pinned.empty())
+            {
+                t = own.pinned.pop_front();
+                --own.pinned_count;
+                return true;
+            }
+        }
+        for (unsigned i = 0; i < size(); ++i)
+        {
+            queue& q = *_queues[(worker + i) % size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty())
+            {
+                // own tasks LIFO while they are hot in cache, steal FIFO
+                t = i == 0 ? q.tasks.pop_back() : q.tasks.pop_front();
+                --_queued;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * stops and joins the workers started so far
+     */
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (auto& thread: _threads)
+        {
+            thread.join();
+        }
+    }
+
+    void work(unsigned worker)
+    {
+        current().pool = this;
+        current().worker = worker;
+        for (;;)
+        {
+            task t;
+            if (pop(worker, t))
+            {
+                t.fn(t.context, t.index, worker);
+                _cpus[worker].store(current_cpu(), std::memory_order_relaxed);
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (--_pending == 0)
+                {
+                    _done.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            queue& own = *_queues[worker];
+            _wake.wait(lock, [&] { return _stop || _queued > 0 || own.pinned_count > 0; });
+            if (_stop && _queued == 0 && own.pinned_count == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<queue>> _queues;
+    std::vector<std::thread> _threads;
+    std::unique_ptr<std::atomic<int>[]> _cpus;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    // tasks sitting in some deque
+    std::atomic<std::size_t> _queued;
+    // tasks queued or running
+    std::size_t _pending;
+    std::atomic<unsigned> _next;
+    bool _stop;
+};
+
+#endif